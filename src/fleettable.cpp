@@ -0,0 +1,49 @@
+#include "fleettable.h"
+
+#include <algorithm>
+#include <bit>
+#include <utility>
+
+size_t FleetTable::slotFor(uint64_t key) const
+{
+    const size_t mask = slots_.size() - 1u;
+    size_t i = size_t(hash(key)) & mask;
+    while (slots_[i].state != FleetEntry::Empty && slots_[i].key() != key)
+        i = (i + 1u) & mask;
+    return i;
+}
+
+void FleetTable::rehash(size_t capacity)
+{
+    std::vector<FleetEntry> old(capacity);
+    old.swap(slots_);
+    for (const auto &e : old)
+        if (e.state != FleetEntry::Empty) slots_[slotFor(e.key())] = e;
+}
+
+void FleetTable::reserve(size_t n)
+{
+    const size_t capacity = std::bit_ceil(std::max<size_t>(n * 2u, 16u));
+    if (capacity > slots_.size()) rehash(capacity);
+}
+
+std::pair<FleetEntry *, bool> FleetTable::insert(const FleetEntry &e)
+{
+    if ((count + 1u) * 2u > slots_.size()) reserve(count + 1u);
+    FleetEntry &slot = slots_[slotFor(e.key())];
+    if (slot.state != FleetEntry::Empty) return {&slot, false};
+    slot = e;
+    ++count;
+    return {&slot, true};
+}
+
+FleetEntry *FleetTable::find(Proto proto, uint16_t extPort, uint32_t client)
+{
+    if (slots_.empty()) return nullptr;
+    FleetEntry probe;
+    probe.client = client;
+    probe.extPort = extPort;
+    probe.proto = proto;
+    FleetEntry &slot = slots_[slotFor(probe.key())];
+    return slot.state != FleetEntry::Empty ? &slot : nullptr;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "portset.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/// One port mapping managed on behalf of a LAN host in fleet mode, along with its scheduling state. Kept to 16 bytes
+/// so that tables of tens of thousands of mappings stay small and scanning them stays cheap.
+struct FleetEntry {
+    enum State : uint8_t {
+        Empty = 0, ///< unused hash table slot
+        Wanted,    ///< not (yet) mapped: (re)try at `due`
+        Mapped,    ///< mapped: renew at `due`
+        Parked,    ///< the router keeps refusing it, so we leave it alone
+    };
+
+    uint32_t client = 0; ///< internal client's IPv4 address, in host byte order
+    uint16_t extPort = 0, inPort = 0;
+    Proto proto = Proto::TCP;
+    State state = Empty;
+    uint16_t backoff = 0; ///< delay in seconds before the last retry, 0 if the last attempt succeeded (or none was made)
+    uint32_t due = 0; ///< seconds since the owner's epoch
+
+    /// The key: the router identifies a mapping by (protocol, external port), and we also key by internal client
+    uint64_t key() const { return uint64_t(client) << 32 | uint64_t(extPort) << 8 | uint64_t(proto); }
+};
+static_assert(sizeof(FleetEntry) == 16);
+
+/// A flat, open-addressing hash table of FleetEntry, keyed by FleetEntry::key(), with linear probing. The capacity is
+/// a power of two kept at least twice the number of entries. Entries are never removed (a fleet is fixed once
+/// started), so there are no tombstones, and iterating is a linear scan over one contiguous array.
+class FleetTable
+{
+public:
+    FleetTable() = default;
+
+    static uint64_t hash(uint64_t key) {
+        // splitmix64 finalizer: the keys have most of their entropy in a few bits, which this spreads across all 64
+        key ^= key >> 30; key *= 0xbf58476d1ce4e5b9ull;
+        key ^= key >> 27; key *= 0x94d049bb133111ebull;
+        return key ^ (key >> 31);
+    }
+
+    /// Make room for `n` entries in all, so that inserting them won't rehash
+    void reserve(size_t n);
+
+    /// Inserts `e` (whose state must not be Empty) and returns a pointer to it, or returns a pointer to the existing
+    /// entry with the same key, leaving it unchanged. The second member is true if `e` was inserted.
+    std::pair<FleetEntry *, bool> insert(const FleetEntry &e);
+    /// Returns the entry for the given key, or nullptr if there is none
+    FleetEntry *find(Proto proto, uint16_t extPort, uint32_t client);
+    const FleetEntry *find(Proto proto, uint16_t extPort, uint32_t client) const {
+        return const_cast<FleetTable *>(this)->find(proto, extPort, client);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+
+    /// All the slots, including Empty ones. Slot indices are stable until the next insert.
+    std::vector<FleetEntry> &slots() { return slots_; }
+    const std::vector<FleetEntry> &slots() const { return slots_; }
+
+    /// Calls `f(entry)` for each entry, in slot order
+    template <typename Func>
+    void forEach(Func && f) {
+        for (auto &e : slots_)
+            if (e.state != FleetEntry::Empty) f(e);
+    }
+    template <typename Func>
+    void forEach(Func && f) const {
+        for (const auto &e : slots_)
+            if (e.state != FleetEntry::Empty) f(e);
+    }
+
+private:
+    std::vector<FleetEntry> slots_;
+    size_t count = 0;
+
+    size_t slotFor(uint64_t key) const;
+    void rehash(size_t capacity);
+};
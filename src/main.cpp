@@ -1,13 +1,22 @@
 #include "argparse.hpp"
+#include "netutil.h"
 #include "upnpmgr.h"
 #include "util.h"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <cctype>
+#include <chrono>
 #include <csignal>
 #include <cstdlib>
+#include <fstream>
 #include <limits>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -32,6 +41,106 @@ void waitSem() {
     }
 }
 
+/// Parse a port spec of the form [EXT[-EXT]:]PORT[-PORT][/tcp|/udp|/both] into `ports`, recording in `extPorts` any
+/// external ports that differ from the internal ones. Throws std::invalid_argument on error.
+void parsePortSpec(std::string_view spec, UpnpMgr::PortSets &ports, UpnpMgr::PortMaps &extPorts) {
+    const std::string_view orig = spec;
+    const auto invalid = [orig] { return std::invalid_argument(strprintf("Invalid port or port range: %s", orig)); };
+    bool tcp = true, udp = false;
+    if (const auto slash = spec.find('/'); slash != spec.npos) {
+        std::string suffix(spec.substr(slash + 1));
+        std::transform(suffix.begin(), suffix.end(), suffix.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (suffix == "udp") tcp = false, udp = true;
+        else if (suffix == "both") udp = true;
+        else if (suffix != "tcp") throw invalid();
+        spec = spec.substr(0, slash);
+    }
+    std::optional<PortSet::Range> ext;
+    if (const auto colon = spec.find(':'); colon != spec.npos) {
+        ext = PortSet::parseRange(spec.substr(0, colon));
+        if (!ext) throw invalid();
+        spec = spec.substr(colon + 1);
+    }
+    const auto range = PortSet::parseRange(spec);
+    if (!range) throw invalid();
+    if (!ext) ext = range;
+    else if (ext->size() != range->size())
+        throw std::invalid_argument(strprintf("External and internal port ranges differ in size: %s", orig));
+
+    for (const Proto p : AllProtos) {
+        if (p == Proto::TCP ? !tcp : !udp) continue;
+        PortSet &ps = ports[size_t(p)];
+        PortMap &pm = extPorts[size_t(p)];
+        // A port already asked for must keep the external port it was asked for with
+        for (uint32_t prt = range->first; prt <= range->last; ++prt)
+            if (ps.contains(uint16_t(prt)) && pm.external(uint16_t(prt)) != ext->first + (prt - range->first))
+                throw std::invalid_argument(strprintf("Port %u/%s is given more than one external port", prt,
+                                                      protoName(p)));
+        if (!pm.insert(*range, ext->first)) throw invalid();
+        ps.insert(*range);
+    }
+}
+
+/// Throws std::invalid_argument if two of the ports would need the same external port
+void checkExternalPorts(const UpnpMgr::PortSets &ports, const UpnpMgr::PortMaps &extPorts) {
+    for (const Proto p : AllProtos) {
+        PortBitmap seen;
+        for (const uint16_t prt : ports[size_t(p)]) {
+            const uint16_t ext = extPorts[size_t(p)].external(prt);
+            if (seen.test(ext))
+                throw std::invalid_argument(strprintf("External port %u/%s is asked for more than once", ext,
+                                                      protoName(p)));
+            seen.set(ext);
+        }
+    }
+}
+
+/// Load a fleet file into `fleet`. Each line names a LAN host's IPv4 address followed by one or more port specs, as
+/// accepted by parsePortSpec(), to map to that host; blank lines and lines starting with '#' are ignored. Throws
+/// std::invalid_argument on error.
+void loadFleet(const std::string &path, FleetTable &fleet) {
+    std::ifstream f(path);
+    if (!f) throw std::invalid_argument(strprintf("Cannot open fleet file: %s", path));
+    std::array<PortBitmap, NumProtos> taken; // external ports in use, since the router can only map each one once
+    std::string line;
+    for (unsigned lineNo = 1; std::getline(f, line); ++lineNo) {
+        std::istringstream ss(line);
+        std::string host, spec;
+        if (!(ss >> host) || host.front() == '#') continue;
+        const auto where = [&] { return strprintf("%s:%u: ", path, lineNo); };
+        const auto client = Net::parseIPv4(host);
+        if (!client) throw std::invalid_argument(where() + strprintf("Invalid IPv4 address: %s", host));
+        UpnpMgr::PortSets ports;
+        UpnpMgr::PortMaps extPorts;
+        bool any = false;
+        while (ss >> spec) {
+            try {
+                parsePortSpec(spec, ports, extPorts);
+            } catch (const std::invalid_argument &e) {
+                throw std::invalid_argument(where() + e.what());
+            }
+            any = true;
+        }
+        if (!any) throw std::invalid_argument(where() + strprintf("No ports given for %s", host));
+        for (const Proto p : AllProtos) {
+            for (const uint16_t prt : ports[size_t(p)]) {
+                FleetEntry e;
+                e.client = *client;
+                e.proto = p;
+                e.inPort = prt;
+                e.extPort = extPorts[size_t(p)].external(prt);
+                e.state = FleetEntry::Wanted;
+                if (taken[size_t(p)].test(e.extPort))
+                    throw std::invalid_argument(where() + strprintf("External port %u/%s is asked for more than once",
+                                                                    e.extPort, protoName(p)));
+                taken[size_t(p)].set(e.extPort);
+                fleet.insert(e);
+            }
+        }
+    }
+    if (fleet.empty()) throw std::invalid_argument(strprintf("No mappings in fleet file: %s", path));
+}
+
 extern "C" void sigHandler(int sig) {
     if (bool val = false; no_more_signals.compare_exchange_strong(val, true)) {
         AsyncSignalSafe::writeStdErr(AsyncSignalSafe::SBuf(" --- Got signal: ", sig, ", exiting ---"));
@@ -45,22 +154,124 @@ int main(int argc, char *argv[])
     const char *name = PACKAGE_NAME, *version = PACKAGE_VERSION;
     argparse::ArgumentParser parser(name, version);
     parser.add_argument("port")
-        .help("One or more ports to open up on the router")
-        .nargs(argparse::nargs_pattern::at_least_one)
-        .scan<'u', uint16_t>();
+        .help("One or more ports or port ranges to open up on the router, each optionally suffixed with /tcp, /udp or"
+              " /both (default: tcp), e.g. 8000-9999/udp. Prefix a port or range with EXT: to have the router forward"
+              " a different external port (range of the same size) to it, e.g. 80:8080 or 9000-9009:8000-8009/both")
+        .nargs(argparse::nargs_pattern::any);
     parser.add_argument("-d", "--debug")
         .default_value(false)
         .implicit_value(true)
         .help("Enable extra debug logging");
+    parser.add_argument("-j", "--jobs")
+        .default_value(UpnpMgr::DefaultMaxJobs)
+        .help("Maximum number of concurrent port mapping requests to send to the router")
+        .scan<'u', unsigned>();
+    parser.add_argument("-l", "--lease")
+        .default_value(unsigned(UpnpMgr::DefaultLease.count()))
+        .help("Lease duration in seconds to request for each mapping; mappings are renewed before they expire."
+              " 0 requests permanent mappings")
+        .scan<'u', unsigned>();
+    parser.add_argument("--verify")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Check whether the router already has each mapping before (re)adding it, and skip the write if so");
+    parser.add_argument("--reconcile")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Read the router's whole mapping table when renewals are due and only (re)add the mappings that are"
+              " missing from it (faster than --verify when managing many ports)");
+    parser.add_argument("--any-port")
+        .default_value(false)
+        .implicit_value(true)
+        .help("If an external port is already taken, let the router pick another one instead (IGDv2 routers only)");
+    parser.add_argument("--retry-cap")
+        .default_value(unsigned(UpnpMgr::DefaultRetryCap.count()))
+        .help("Failed mappings are retried with exponential backoff; this is the maximum delay between retries, in"
+              " seconds")
+        .scan<'u', unsigned>();
+    parser.add_argument("--shutdown-timeout")
+        .default_value(unsigned(UpnpMgr::DefaultShutdownTimeout.count()))
+        .help("Maximum time in seconds to spend removing the mappings from the router on exit")
+        .scan<'u', unsigned>();
+    parser.add_argument("--all-igds")
+        .default_value(false)
+        .implicit_value(true)
+        .help("Open the ports on every router found on the network, rather than just the best one");
+    parser.add_argument("--fleet")
+        .help("Instead of opening ports for this host, open them for the LAN hosts listed in this file, one per line:"
+              " an IPv4 address followed by the port specs for it, e.g. 192.168.1.20 8000-8009/udp 80:8080");
+    parser.add_argument("--discover-timeout")
+        .default_value(unsigned(UpnpMgr::DefaultDiscoverTimeout.count()))
+        .help("Maximum time in milliseconds to wait for routers to answer discovery (we stop at the first usable one,"
+              " and once we have seen how fast they answer, first try a shorter wait)")
+        .scan<'u', unsigned>();
+    parser.add_argument("--igd-url")
+        .help("Use the router whose root description is at this URL instead of discovering one, e.g."
+              " http://192.168.1.1:5000/rootDesc.xml");
+    parser.add_argument("--igd-cache")
+        .help("Remember the router in this file, so that the next start can skip discovery if it is still there");
+    parser.add_argument("--workers")
+        .default_value(UpnpMgr::DefaultFleetWorkers)
+        .help("Number of threads to spread the --fleet mappings across, each with its own --jobs connections")
+        .scan<'u', unsigned>();
 
 
-    UpnpMgr::PortVec ports;
+    UpnpMgr::PortSets ports;
+    UpnpMgr::Options options;
     try {
         parser.parse_args(argc, argv);
-        // Grab port positional arg(s)
-        ports = parser.get<UpnpMgr::PortVec>("port");
+        // Grab port positional arg(s), or the --fleet file
+        const auto specs = parser.get<std::vector<std::string>>("port");
+        if (const auto fleetFile = parser.present("--fleet")) {
+            if (!specs.empty() || parser.get<bool>("--all-igds") || parser.get<bool>("--verify")
+                    || parser.get<bool>("--reconcile") || parser.get<bool>("--any-port"))
+                throw std::invalid_argument("--fleet can't be combined with port arguments, --all-igds, --verify,"
+                                            " --reconcile or --any-port");
+            loadFleet(*fleetFile, options.fleet);
+        } else if (specs.empty()) {
+            throw std::invalid_argument("Pass one or more ports, or --fleet");
+        }
+        for (const auto &spec : specs)
+            parsePortSpec(spec, ports, options.extPorts);
+        checkExternalPorts(ports, options.extPorts);
         // Interpret -d option
         Log::logLevel = int(parser.get<bool>("-d") ? Log::Level::Debug : Log::Level::Info);
+        // Interpret -j option
+        options.maxJobs = parser.get<unsigned>("-j");
+        if (!options.maxJobs) throw std::invalid_argument("--jobs must be at least 1");
+        // Interpret -l option
+        options.lease = std::chrono::seconds{parser.get<unsigned>("-l")};
+        if (options.lease.count() && options.lease < std::chrono::minutes{1})
+            throw std::invalid_argument("--lease must be 0 or at least 60 seconds");
+        // Interpret --verify option
+        options.verify = parser.get<bool>("--verify");
+        // Interpret --reconcile option
+        options.reconcile = parser.get<bool>("--reconcile");
+        // Interpret --any-port option
+        options.anyPort = parser.get<bool>("--any-port");
+        // Interpret --retry-cap option
+        options.retryCap = std::chrono::seconds{parser.get<unsigned>("--retry-cap")};
+        if (options.retryCap < UpnpMgr::RetryBase)
+            throw std::invalid_argument(strprintf("--retry-cap must be at least %d seconds", UpnpMgr::RetryBase.count()));
+        // Interpret --shutdown-timeout option
+        options.shutdownTimeout = std::chrono::seconds{parser.get<unsigned>("--shutdown-timeout")};
+        // Interpret --all-igds option
+        options.allIgds = parser.get<bool>("--all-igds");
+        // Interpret --discover-timeout option
+        options.discoverTimeout = std::chrono::milliseconds{parser.get<unsigned>("--discover-timeout")};
+        if (options.discoverTimeout < std::chrono::milliseconds{100})
+            throw std::invalid_argument("--discover-timeout must be at least 100 milliseconds");
+        // Interpret --igd-url option
+        if (const auto url = parser.present("--igd-url")) {
+            if (!Net::parseHttpUrl(*url)) throw std::invalid_argument(strprintf("Invalid --igd-url: %s", *url));
+            if (options.allIgds) throw std::invalid_argument("--igd-url can't be combined with --all-igds");
+            options.igdUrl = *url;
+        }
+        // Interpret --igd-cache option
+        if (const auto path = parser.present("--igd-cache")) options.igdCache = *path;
+        // Interpret --workers option
+        options.fleetWorkers = parser.get<unsigned>("--workers");
+        if (!options.fleetWorkers) throw std::invalid_argument("--workers must be at least 1");
     } catch (const std::exception &e) {
         // Rewrite some of the obscure errors that the ArgParser sends
         (Error() << e.what()).useStdOut = false;
@@ -107,7 +318,7 @@ int main(int argc, char *argv[])
                 std::signal(sig, orig_val);
         });
 
-        upnp.start(std::move(ports), /* errorCallback = */[&exitCode]{
+        upnp.start(std::move(ports), options, /* errorCallback = */[&exitCode]{
             // this runs in cliupnp thread in case of error
             exitCode = EXIT_FAILURE;
             if (bool val = false; no_more_signals.compare_exchange_strong(val, true)) {
@@ -0,0 +1,382 @@
+#include "netutil.h"
+#include "util.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+#if WINDOWS
+#  define WIN32_LEAN_AND_MEAN 1
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <ifaddrs.h>
+#  include <net/if.h>
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <sys/types.h>
+#  include <unistd.h>
+#endif
+#ifdef __linux__
+#  include <sys/epoll.h>
+#endif
+
+namespace Net {
+
+
+std::string HttpUrl::hostHeader() const {
+    const bool ipv6 = host.find(':') != host.npos;
+    std::string ret = ipv6 ? "[" + host + "]" : host;
+    if (port != 80) ret += strprintf(":%u", port);
+    return ret;
+}
+
+std::optional<HttpUrl> parseHttpUrl(std::string_view url) {
+    constexpr std::string_view scheme = "http://";
+    if (url.size() < scheme.size()
+            || !std::equal(scheme.begin(), scheme.end(), url.begin(),
+                           [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); }))
+        return std::nullopt;
+    url.remove_prefix(scheme.size());
+
+    HttpUrl ret;
+    std::string_view authority = url.substr(0, url.find('/'));
+    if (authority.size() < url.size()) ret.path = url.substr(authority.size());
+
+    std::string_view portStr;
+    if (!authority.empty() && authority.front() == '[') {
+        // IPv6 literal, e.g. [fe80::1%eth0]:5000
+        const auto rb = authority.find(']');
+        if (rb == authority.npos) return std::nullopt;
+        ret.host = authority.substr(1, rb - 1);
+        if (rb + 1 < authority.size()) {
+            if (authority[rb + 1] != ':') return std::nullopt;
+            portStr = authority.substr(rb + 2);
+        }
+    } else {
+        const auto colon = authority.find(':');
+        ret.host = authority.substr(0, colon);
+        if (colon != authority.npos) portStr = authority.substr(colon + 1);
+    }
+    if (ret.host.empty()) return std::nullopt;
+    if (!portStr.empty()) {
+        const auto [p, ec] = std::from_chars(portStr.data(), portStr.data() + portStr.size(), ret.port);
+        if (ec != std::errc{} || p != portStr.data() + portStr.size() || !ret.port) return std::nullopt;
+    }
+    return ret;
+}
+
+std::optional<uint32_t> parseIPv4(std::string_view s) {
+    uint32_t ret = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (i) {
+            if (s.empty() || s.front() != '.') return std::nullopt;
+            s.remove_prefix(1);
+        }
+        uint8_t octet{};
+        const auto [p, ec] = std::from_chars(s.data(), s.data() + s.size(), octet);
+        if (ec != std::errc{} || p == s.data() || p - s.data() > 3) return std::nullopt;
+        s.remove_prefix(size_t(p - s.data()));
+        ret = ret << 8 | octet;
+    }
+    if (!s.empty()) return std::nullopt;
+    return ret;
+}
+
+std::string formatIPv4(uint32_t addr) {
+    return strprintf("%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xffu, (addr >> 8) & 0xffu, addr & 0xffu);
+}
+
+void Socket::close() noexcept {
+    if (fd == InvalidSock) return;
+#if WINDOWS
+    ::closesocket(SOCKET(fd));
+#else
+    ::close(fd);
+#endif
+    fd = InvalidSock;
+}
+
+int lastError() {
+#if WINDOWS
+    return ::WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+std::string errorString(int err) {
+#if WINDOWS
+    char buf[256] = {};
+    ::FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, nullptr, DWORD(err), 0, buf,
+                     sizeof(buf) - 1, nullptr);
+    return strprintf("(%d) %s", err, buf);
+#else
+    return strprintf("(%d) %s", err, std::strerror(err));
+#endif
+}
+
+bool isWouldBlock(int err) {
+#if WINDOWS
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINPROGRESS || err == EINTR;
+#endif
+}
+
+bool setNonBlocking(SockFd fd) {
+#if WINDOWS
+    u_long on = 1;
+    return ::ioctlsocket(SOCKET(fd), FIONBIO, &on) == 0;
+#else
+    const int flags = ::fcntl(fd, F_GETFL, 0);
+    return flags != -1 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+#endif
+}
+
+Socket startConnect(const std::string &host, uint16_t port, std::string *errStr) {
+    std::string dummy;
+    std::string &err = errStr ? *errStr : dummy;
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (const int r = ::getaddrinfo(host.c_str(), strprintf("%u", port).c_str(), &hints, &res); r != 0 || !res) {
+        err = strprintf("getaddrinfo(%s): %s", host, ::gai_strerror(r));
+        return {};
+    }
+    Defer d([res]{ ::freeaddrinfo(res); });
+
+    // Note: we only try the first address; the control URL of an IGD is pretty much always an IP literal anyway.
+    Socket sock(::socket(res->ai_family, res->ai_socktype, res->ai_protocol));
+    if (!sock || !setNonBlocking(sock.get())) {
+        err = strprintf("socket: %s", errorString(lastError()));
+        return {};
+    }
+    int one = 1;
+    ::setsockopt(sock.get(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&one), sizeof(one));
+#ifdef SO_NOSIGPIPE
+    ::setsockopt(sock.get(), SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    if (::connect(sock.get(), res->ai_addr, socklen_t(res->ai_addrlen)) != 0) {
+        if (const int e = lastError(); !isWouldBlock(e)) {
+            err = strprintf("connect: %s", errorString(e));
+            return {};
+        }
+    }
+    return sock;
+}
+
+int connectResult(SockFd fd) {
+    int soErr = 0;
+    socklen_t len = sizeof(soErr);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&soErr), &len) != 0)
+        return lastError();
+    return soErr;
+}
+
+std::optional<std::string> localAddressFor(const std::string &host, uint16_t port) {
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (::getaddrinfo(host.c_str(), strprintf("%u", port).c_str(), &hints, &res) != 0 || !res) return std::nullopt;
+    Defer d([res]{ ::freeaddrinfo(res); });
+    Socket sock(::socket(res->ai_family, res->ai_socktype, res->ai_protocol));
+    sockaddr_storage local{};
+    socklen_t len = sizeof(local);
+    char buf[NI_MAXHOST] = {};
+    if (!sock || ::connect(sock.get(), res->ai_addr, socklen_t(res->ai_addrlen)) != 0
+            || ::getsockname(sock.get(), reinterpret_cast<sockaddr *>(&local), &len) != 0
+            || ::getnameinfo(reinterpret_cast<const sockaddr *>(&local), len, buf, sizeof(buf), nullptr, 0,
+                             NI_NUMERICHOST) != 0)
+        return std::nullopt;
+    return std::string(buf);
+}
+
+std::vector<uint32_t> multicastInterfaces() {
+    std::vector<uint32_t> ret;
+#if !WINDOWS
+    ifaddrs *ifs = nullptr;
+    if (::getifaddrs(&ifs) != 0) return ret;
+    Defer d([ifs]{ ::freeifaddrs(ifs); });
+    for (const ifaddrs *i = ifs; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue;
+        if (!(i->ifa_flags & IFF_UP) || !(i->ifa_flags & IFF_MULTICAST) || (i->ifa_flags & IFF_LOOPBACK)) continue;
+        const uint32_t addr = ntohl(reinterpret_cast<const sockaddr_in *>(i->ifa_addr)->sin_addr.s_addr);
+        if (std::find(ret.begin(), ret.end(), addr) == ret.end()) ret.push_back(addr);
+    }
+#endif
+    return ret;
+}
+
+long sendSome(SockFd fd, const char *buf, std::size_t len) {
+#if WINDOWS
+    return ::send(SOCKET(fd), buf, int(std::min<std::size_t>(len, std::numeric_limits<int>::max())), 0);
+#elif defined(MSG_NOSIGNAL)
+    return ::send(fd, buf, len, MSG_NOSIGNAL);
+#else
+    return ::send(fd, buf, len, 0); // SO_NOSIGPIPE was set in startConnect()
+#endif
+}
+
+long recvSome(SockFd fd, char *buf, std::size_t len) {
+#if WINDOWS
+    return ::recv(SOCKET(fd), buf, int(std::min<std::size_t>(len, std::numeric_limits<int>::max())), 0);
+#else
+    return ::recv(fd, buf, len, 0);
+#endif
+}
+
+Waker::Waker() {
+    // A UDP socket bound to an ephemeral loopback port and connected to itself: unlike pipe() or eventfd(), this works
+    // the same everywhere, including with WSAPoll() on Windows
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    Socket s(::socket(AF_INET, SOCK_DGRAM, 0));
+    if (!s || ::bind(s.get(), reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::getsockname(s.get(), reinterpret_cast<sockaddr *>(&addr), &len) != 0
+            || ::connect(s.get(), reinterpret_cast<const sockaddr *>(&addr), len) != 0
+            || !setNonBlocking(s.get()))
+        throw InternalError(strprintf("Waker: %s", errorString(lastError())));
+    sock = std::move(s);
+}
+
+void Waker::notify() noexcept {
+    const char c = 0;
+    sendSome(sock.get(), &c, 1); // if the socket buffer is full, there is a wake-up pending anyway
+}
+
+void Waker::drain() noexcept {
+    char buf[64];
+    while (recvSome(sock.get(), buf, sizeof(buf)) > 0) {}
+}
+
+namespace {
+/// Clamps `timeout` to the non-negative int range expected by epoll_wait() and poll()
+int toPollTimeout(std::chrono::milliseconds timeout) {
+    return int(std::clamp<int64_t>(timeout.count(), 0, std::numeric_limits<int>::max()));
+}
+} // namespace
+
+#ifdef __linux__
+namespace {
+uint32_t toEpoll(unsigned interest) {
+    return (interest & Poller::Readable ? EPOLLIN : 0u) | (interest & Poller::Writable ? EPOLLOUT : 0u);
+}
+} // namespace
+
+Poller::Poller() : epfd(::epoll_create1(EPOLL_CLOEXEC)) {
+    if (epfd < 0)
+        throw InternalError(strprintf("epoll_create1: %s", errorString(lastError())));
+}
+
+Poller::~Poller() { ::close(epfd); }
+
+bool Poller::add(SockFd fd, unsigned interest, void *tag) {
+    epoll_event ev{};
+    ev.events = toEpoll(interest);
+    ev.data.ptr = tag;
+    return ::epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool Poller::modify(SockFd fd, unsigned interest, void *tag) {
+    epoll_event ev{};
+    ev.events = toEpoll(interest);
+    ev.data.ptr = tag;
+    return ::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Poller::remove(SockFd fd) {
+    epoll_event ev{}; // non-null pointer required by kernels < 2.6.9
+    ::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int Poller::wait(std::vector<Event> &out, std::chrono::milliseconds timeout) {
+    out.clear();
+    std::array<epoll_event, 64> evs;
+    const int n = ::epoll_wait(epfd, evs.data(), int(evs.size()), toPollTimeout(timeout));
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < n; ++i) {
+        unsigned events = 0;
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) events |= Readable;
+        if (evs[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) events |= Writable;
+        out.push_back({evs[i].data.ptr, events});
+    }
+    return n;
+}
+#else /* !__linux__ */
+namespace {
+short toPoll(unsigned interest) {
+    return short((interest & Poller::Readable ? POLLIN : 0) | (interest & Poller::Writable ? POLLOUT : 0));
+}
+} // namespace
+
+Poller::Poller() {}
+
+Poller::~Poller() {}
+
+bool Poller::add(SockFd fd, unsigned interest, void *tag) {
+    entries.push_back({fd, interest, tag});
+    return true;
+}
+
+bool Poller::modify(SockFd fd, unsigned interest, void *tag) {
+    for (auto &e : entries) {
+        if (e.fd == fd) {
+            e.interest = interest;
+            e.tag = tag;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Poller::remove(SockFd fd) {
+    std::erase_if(entries, [fd](const Entry &e) { return e.fd == fd; });
+}
+
+int Poller::wait(std::vector<Event> &out, std::chrono::milliseconds timeout) {
+    out.clear();
+#if WINDOWS
+    std::vector<WSAPOLLFD> pfds(entries.size());
+#else
+    std::vector<pollfd> pfds(entries.size());
+#endif
+    for (size_t i = 0; i < entries.size(); ++i) {
+        pfds[i].fd = decltype(pfds[i].fd)(entries[i].fd);
+        pfds[i].events = toPoll(entries[i].interest);
+    }
+    const int tmo = toPollTimeout(timeout);
+#if WINDOWS
+    // WSAPoll() doesn't like an empty set
+    if (pfds.empty()) { ::Sleep(DWORD(tmo)); return 0; }
+    const int n = ::WSAPoll(pfds.data(), ULONG(pfds.size()), tmo);
+#else
+    const int n = ::poll(pfds.data(), nfds_t(pfds.size()), tmo);
+#endif
+    if (n < 0) return isWouldBlock(lastError()) ? 0 : -1;
+    for (size_t i = 0; i < pfds.size(); ++i) {
+        const short re = pfds[i].revents;
+        if (!re) continue;
+        unsigned events = 0;
+        if (re & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) events |= Readable;
+        if (re & (POLLOUT | POLLHUP | POLLERR | POLLNVAL)) events |= Writable;
+        out.push_back({entries[i].tag, events});
+    }
+    return int(out.size());
+}
+#endif /* __linux__ */
+
+} // namespace Net
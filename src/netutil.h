@@ -0,0 +1,139 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Thin portability layer over BSD sockets / Winsock, used by the bits of code that talk to the router directly
+/// (rather than via miniupnpc).
+namespace Net {
+
+#if WINDOWS
+using SockFd = std::uintptr_t; ///< same as Winsock's SOCKET type
+inline constexpr SockFd InvalidSock = ~SockFd(0); ///< same as Winsock's INVALID_SOCKET
+#else
+using SockFd = int;
+inline constexpr SockFd InvalidSock = -1;
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+/// The parsed pieces of an "http://host[:port][/path]" URL
+struct HttpUrl {
+    std::string host; ///< hostname or IP address (IPv6 addresses without the enclosing brackets)
+    uint16_t port = 80;
+    std::string path = "/";
+
+    /// Returns the value suitable for an HTTP "Host:" header, e.g. "192.168.1.1:5000" or "[fe80::1]:5000"
+    std::string hostHeader() const;
+};
+
+/// Returns a parsed URL, or std::nullopt if `url` is not a well-formed http:// URL.
+std::optional<HttpUrl> parseHttpUrl(std::string_view url);
+
+/// Parses a dotted-quad IPv4 address such as "192.168.1.20", returning it in host byte order, or std::nullopt if
+/// `s` is not one.
+std::optional<uint32_t> parseIPv4(std::string_view s);
+/// Formats an IPv4 address given in host byte order as a dotted quad
+std::string formatIPv4(uint32_t addr);
+
+/// RAII owner of a socket descriptor. Movable but not copyable.
+class Socket
+{
+    SockFd fd = InvalidSock;
+public:
+    Socket() noexcept = default;
+    explicit Socket(SockFd fd_) noexcept : fd(fd_) {}
+    ~Socket() { close(); }
+
+    Socket(Socket && o) noexcept : fd(o.release()) {}
+    Socket &operator=(Socket && o) noexcept { if (this != &o) { close(); fd = o.release(); } return *this; }
+    Socket(const Socket &) = delete;
+    Socket &operator=(const Socket &) = delete;
+
+    SockFd get() const noexcept { return fd; }
+    explicit operator bool() const noexcept { return fd != InvalidSock; }
+    /// Give up ownership of the descriptor without closing it
+    SockFd release() noexcept { const SockFd ret = fd; fd = InvalidSock; return ret; }
+    void close() noexcept;
+};
+
+/// Returns the last socket error for this thread (errno or WSAGetLastError())
+int lastError();
+/// Returns a human-readable description of a socket error code
+std::string errorString(int err);
+/// Returns true if `err` just means "try again later" for a non-blocking socket
+bool isWouldBlock(int err);
+
+bool setNonBlocking(SockFd fd);
+
+/// Begin a non-blocking TCP connect to host:port. On immediate failure an invalid Socket is returned and `*errStr` (if
+/// specified) is set to a description of the problem. Otherwise the connect may still be in progress: wait for the
+/// socket to become writable, then consult connectResult().
+Socket startConnect(const std::string &host, uint16_t port, std::string *errStr = nullptr);
+/// Returns 0 if the connect started by startConnect() succeeded, or else the socket error code.
+int connectResult(SockFd fd);
+/// Returns the local IP address the OS would use to reach host:port (found by connecting a UDP socket, so that nothing
+/// is actually sent), or std::nullopt on error.
+std::optional<std::string> localAddressFor(const std::string &host, uint16_t port);
+
+/// Returns the IPv4 addresses (in host byte order) of the interfaces that are up and can send multicast, loopback
+/// excluded. Returns an empty vector where interfaces can't be enumerated (Windows), or on error.
+std::vector<uint32_t> multicastInterfaces();
+
+/// Thin wrappers around send() and recv(), returning the number of bytes transferred, 0 on EOF (recvSome only), or
+/// -1 on error (consult lastError()). sendSome() never raises SIGPIPE.
+long sendSome(SockFd fd, const char *buf, std::size_t len);
+long recvSome(SockFd fd, char *buf, std::size_t len);
+
+/// Readiness notification for a set of non-blocking sockets. Uses epoll on Linux and poll() (WSAPoll() on Windows)
+/// elsewhere. Each registered socket carries an opaque `tag` that is handed back in the events for it.
+class Poller
+{
+public:
+    enum Interest : unsigned { Readable = 0x1, Writable = 0x2 };
+    struct Event {
+        void *tag;
+        unsigned events; ///< bitwise-or of Interest flags. Errors and hangups are reported as Readable | Writable.
+    };
+
+    Poller(); ///< may throw InternalError if the OS refuses to give us an epoll instance
+    ~Poller();
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    bool add(SockFd fd, unsigned interest, void *tag);
+    bool modify(SockFd fd, unsigned interest, void *tag);
+    /// Must be called before the socket is closed
+    void remove(SockFd fd);
+
+    /// Wait up to `timeout` for events, which are placed in `out` (which is cleared first). Returns the number of
+    /// events, or -1 on error.
+    int wait(std::vector<Event> &out, std::chrono::milliseconds timeout);
+
+private:
+#ifdef __linux__
+    int epfd = -1;
+#else
+    struct Entry { SockFd fd; unsigned interest; void *tag; };
+    std::vector<Entry> entries;
+#endif
+};
+
+/// A loopback UDP socket that another thread can use to wake up a Poller the socket is registered with (for
+/// Readable). notify() is thread-safe; the polling thread should drain() whenever the socket becomes readable.
+class Waker
+{
+    Socket sock;
+public:
+    Waker(); ///< may throw InternalError if the OS refuses to give us a loopback socket
+    SockFd fd() const { return sock.get(); }
+    void notify() noexcept;
+    void drain() noexcept;
+};
+
+} // namespace Net
@@ -0,0 +1,86 @@
+#include "netwatch.h"
+#include "netutil.h"
+#include "threadinterrupt.h"
+#include "util.h"
+
+#include <chrono>
+#include <optional>
+#include <vector>
+
+#ifdef __linux__
+#  include <cerrno>
+#  include <linux/netlink.h>
+#  include <linux/rtnetlink.h>
+#  include <sys/socket.h>
+#endif
+
+namespace Net {
+
+#ifdef __linux__
+bool watchAddresses(const std::function<void()> &onChange, const ThreadInterrupt &interrupt) {
+    Socket sock(::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE));
+    if (!sock || !setNonBlocking(sock.get())) return false;
+    sockaddr_nl local{};
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+    if (::bind(sock.get(), reinterpret_cast<const sockaddr *>(&local), sizeof(local)) != 0) {
+        Debug("Can't watch for address changes: %s", errorString(lastError()));
+        return false;
+    }
+
+    std::optional<Poller> optPoller;
+    std::optional<Waker> optWaker;
+    try {
+        optPoller.emplace();
+        optWaker.emplace();
+    } catch (const InternalError &e) {
+        Error() << "Can't watch for address changes: " << e.what();
+        return false;
+    }
+    Poller &poller = *optPoller;
+    Waker &waker = *optWaker;
+    if (!poller.add(waker.fd(), Poller::Readable, &waker) || !poller.add(sock.get(), Poller::Readable, nullptr))
+        return false;
+    Defer d([&]{ poller.remove(sock.get()); poller.remove(waker.fd()); });
+    const size_t subscription = interrupt.subscribe([&waker] { waker.notify(); });
+    Defer d2([&] { interrupt.unsubscribe(subscription); });
+
+    // A DHCP renewal or a link coming up is a burst of messages (address deleted, address added, routes added...).
+    // We wait for things to go quiet for this long before reporting them all as one change.
+    constexpr std::chrono::milliseconds Settle{250};
+    bool pending = false;
+    std::vector<Poller::Event> events;
+    alignas(nlmsghdr) char buf[8192];
+    while (!interrupt) {
+        const int n = poller.wait(events, pending ? Settle : std::chrono::minutes{1});
+        if (n < 0) break;
+        if (!n && pending) {
+            pending = false;
+            onChange();
+            continue;
+        }
+        for (const auto &ev : events) {
+            if (ev.tag == &waker) waker.drain(); // the interrupt is checked at the top of the loop
+        }
+        long len;
+        while ((len = recvSome(sock.get(), buf, sizeof(buf))) > 0) {
+            int left = int(len);
+            for (auto *h = reinterpret_cast<const nlmsghdr *>(buf); NLMSG_OK(h, left); h = NLMSG_NEXT(h, left)) {
+                if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR) {
+                    pending = true;
+                } else if (h->nlmsg_type == RTM_NEWROUTE || h->nlmsg_type == RTM_DELROUTE) {
+                    // Skip the local and broadcast routes the kernel adds along with each address
+                    pending |= static_cast<const rtmsg *>(NLMSG_DATA(h))->rtm_table == RT_TABLE_MAIN;
+                }
+            }
+        }
+        // The kernel drops messages when we fall behind; we then can't tell what they were, so assume the worst
+        if (len < 0 && lastError() == ENOBUFS) pending = true;
+    }
+    return true;
+}
+#else
+bool watchAddresses(const std::function<void()> &, const ThreadInterrupt &) { return false; }
+#endif
+
+} // namespace Net
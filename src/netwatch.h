@@ -0,0 +1,15 @@
+#pragma once
+
+#include <functional>
+
+class ThreadInterrupt;
+
+namespace Net {
+
+/// Waits for the kernel to report changes to this host's IPv4 addresses or main routing table (a new DHCP lease, a
+/// different default route...), and calls `onChange` once each burst of them has settled, until `interrupt` is set.
+/// Returns false, right away, where changes can't be watched: anywhere but Linux, where we use rtnetlink, or if the
+/// OS won't give us the sockets to do it.
+bool watchAddresses(const std::function<void()> &onChange, const ThreadInterrupt &interrupt);
+
+} // namespace Net
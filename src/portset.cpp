@@ -0,0 +1,138 @@
+#include "portset.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <utility>
+
+void PortSet::insert(uint16_t first, uint16_t last)
+{
+    if (first > last) std::swap(first, last);
+    // Find the first range that overlaps or abuts [first, last], then swallow every range after it that does too
+    auto it = std::lower_bound(ranges_.begin(), ranges_.end(), first, [](const Range &r, uint16_t f) {
+        return uint32_t(r.last) + 1u < f;
+    });
+    Range merged{first, last};
+    auto jt = it;
+    for ( ; jt != ranges_.end() && uint32_t(jt->first) <= uint32_t(merged.last) + 1u; ++jt) {
+        merged.first = std::min(merged.first, jt->first);
+        merged.last = std::max(merged.last, jt->last);
+        count -= jt->size();
+    }
+    it = ranges_.erase(it, jt);
+    ranges_.insert(it, merged);
+    count += merged.size();
+}
+
+bool PortSet::contains(uint16_t port) const
+{
+    const auto it = std::lower_bound(ranges_.begin(), ranges_.end(), port, [](const Range &r, uint16_t p) {
+        return r.last < p;
+    });
+    return it != ranges_.end() && it->first <= port;
+}
+
+std::string PortSet::toString() const
+{
+    std::string ret;
+    for (const auto &r : ranges_) {
+        if (!ret.empty()) ret += ',';
+        ret += r.first == r.last ? strprintf("%u", r.first) : strprintf("%u-%u", r.first, r.last);
+    }
+    return ret;
+}
+
+/* static */
+std::optional<PortSet::Range> PortSet::parseRange(std::string_view spec)
+{
+    const auto parsePort = [](std::string_view sv) -> std::optional<uint16_t> {
+        uint16_t port{};
+        const auto [p, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), port);
+        if (ec != std::errc{} || p != sv.data() + sv.size() || !port) return std::nullopt;
+        return port;
+    };
+    const auto dash = spec.find('-');
+    const auto first = parsePort(spec.substr(0, dash));
+    const auto last = dash == spec.npos ? first : parsePort(spec.substr(dash + 1));
+    if (!first || !last || *first > *last) return std::nullopt;
+    return Range{*first, *last};
+}
+
+bool PortMap::insert(const PortSet::Range &in, uint16_t extFirst)
+{
+    if (uint32_t(extFirst) + (in.last - in.first) > 65535u) return false;
+    // Ports that map to themselves need no run, but must not contradict an existing one either
+    for (uint32_t p = in.first; p <= in.last; ++p)
+        if (const uint16_t ext = external(uint16_t(p)); ext != p && ext != uint16_t(extFirst + (p - in.first)))
+            return false;
+    if (extFirst == in.first) return true;
+
+    // Runs overlapping `in` translate its ports exactly as we would (checked above), so we fold them into one, along
+    // with any neighbour that abuts it and continues the same translation
+    const auto offset = [](uint16_t i, uint16_t e) { return int(e) - int(i); };
+    const int off = offset(in.first, extFirst);
+    Run merged{in.first, in.last, extFirst};
+    auto it = std::lower_bound(runs_.begin(), runs_.end(), in.first, [](const Run &r, uint16_t f) {
+        return uint32_t(r.inLast) + 1u < f;
+    });
+    if (it != runs_.end() && it->inLast < in.first && offset(it->inFirst, it->extFirst) != off) ++it;
+    auto jt = it;
+    for ( ; jt != runs_.end() && uint32_t(jt->inFirst) <= uint32_t(merged.inLast) + 1u
+            && offset(jt->inFirst, jt->extFirst) == off; ++jt) {
+        merged.inFirst = std::min(merged.inFirst, jt->inFirst);
+        merged.inLast = std::max(merged.inLast, jt->inLast);
+    }
+    merged.extFirst = uint16_t(merged.inFirst + off);
+    it = runs_.erase(it, jt);
+    runs_.insert(it, merged);
+    return true;
+}
+
+uint16_t PortMap::external(uint16_t in) const
+{
+    const auto it = std::lower_bound(runs_.begin(), runs_.end(), in, [](const Run &r, uint16_t p) {
+        return r.inLast < p;
+    });
+    return it != runs_.end() && it->inFirst <= in ? it->external(in) : in;
+}
+
+std::string PortMap::toString() const
+{
+    std::string ret;
+    for (const auto &r : runs_) {
+        if (!ret.empty()) ret += ',';
+        ret += r.inFirst == r.inLast ? strprintf("%u:%u", r.extFirst, r.inFirst)
+                                     : strprintf("%u-%u:%u-%u", r.extFirst, r.external(r.inLast), r.inFirst, r.inLast);
+    }
+    return ret;
+}
+
+const char *protoName(Proto p)
+{
+    return p == Proto::UDP ? "UDP" : "TCP";
+}
+
+std::optional<Proto> parseProto(std::string_view name)
+{
+    const auto iequals = [name](std::string_view s) {
+        return std::equal(name.begin(), name.end(), s.begin(), s.end(), [](char a, char b) {
+            return std::toupper(static_cast<unsigned char>(a)) == b;
+        });
+    };
+    for (const Proto p : AllProtos)
+        if (iequals(protoName(p))) return p;
+    return std::nullopt;
+}
+
+void PortBitmap::set(const PortSet::Range &r)
+{
+    uint32_t port = r.first;
+    const uint32_t end = uint32_t(r.last) + 1u;
+    // leading partial word
+    for ( ; port < end && port % 64u; ++port) set(uint16_t(port));
+    // whole words
+    for ( ; port + 64u <= end; port += 64u) words[port / 64u] = ~uint64_t(0);
+    // trailing partial word
+    for ( ; port < end; ++port) set(uint16_t(port));
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// A set of port numbers, stored as a sorted vector of disjoint, non-adjacent, inclusive [first, last] ranges. Memory
+/// use is O(number of ranges), so even the full 1-65535 range costs a single element. Iterating yields the individual
+/// ports in ascending order, without ever expanding the set.
+class PortSet
+{
+public:
+    struct Range {
+        uint16_t first, last; ///< inclusive
+        size_t size() const { return size_t(last) - first + 1u; }
+        bool operator==(const Range &) const = default;
+    };
+
+    /// Forward iterator over the individual ports in the set
+    class const_iterator
+    {
+        const Range *r = nullptr, *rend = nullptr;
+        uint32_t port = 0;
+        friend class PortSet;
+        const_iterator(const Range *r_, const Range *rend_) : r(r_), rend(rend_), port(r != rend ? r->first : 0) {}
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = uint16_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const uint16_t *;
+        using reference = uint16_t;
+
+        const_iterator() = default;
+        uint16_t operator*() const { return uint16_t(port); }
+        const_iterator &operator++() {
+            if (port < r->last) ++port;
+            else if (++r != rend) port = r->first;
+            else port = 0;
+            return *this;
+        }
+        const_iterator operator++(int) { auto ret = *this; ++*this; return ret; }
+        bool operator==(const const_iterator &o) const { return r == o.r && port == o.port; }
+    };
+
+    PortSet() = default;
+
+    /// Add all the ports in [first, last] (the arguments may be given in either order)
+    void insert(uint16_t first, uint16_t last);
+    void insert(uint16_t port) { insert(port, port); }
+    void insert(const Range &r) { insert(r.first, r.last); }
+
+    bool contains(uint16_t port) const;
+    /// Number of ports in the set
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+    void clear() { ranges_.clear(); count = 0; }
+
+    const std::vector<Range> &ranges() const { return ranges_; }
+
+    const_iterator begin() const { return {ranges_.data(), ranges_.data() + ranges_.size()}; }
+    const_iterator end() const { return {ranges_.data() + ranges_.size(), ranges_.data() + ranges_.size()}; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    /// Returns e.g. "80,443,8000-9999"
+    std::string toString() const;
+
+    /// Parse a port spec of the form "N" or "N-M", where N and M are in [1, 65535]. Returns std::nullopt on error.
+    static std::optional<Range> parseRange(std::string_view spec);
+
+    bool operator==(const PortSet &) const = default;
+
+private:
+    std::vector<Range> ranges_;
+    size_t count = 0;
+};
+
+/// A translation table from internal to external port numbers. It is stored compactly as a sorted vector of disjoint
+/// runs, each mapping a range of consecutive internal ports onto a range of consecutive external ports, so that even a
+/// translated range of thousands of ports costs a single element. Ports not covered by any run map to themselves.
+class PortMap
+{
+public:
+    struct Run {
+        uint16_t inFirst, inLast; ///< inclusive
+        uint16_t extFirst;
+        uint16_t external(uint16_t in) const { return uint16_t(extFirst + (in - inFirst)); }
+        bool operator==(const Run &) const = default;
+    };
+
+    /// Map the internal ports in `in` onto the external ports starting at `extFirst`. Returns false, changing nothing,
+    /// if the external range would run past 65535 or some of these internal ports are already mapped elsewhere.
+    [[nodiscard]] bool insert(const PortSet::Range &in, uint16_t extFirst);
+
+    /// Returns the external port for internal port `in`
+    uint16_t external(uint16_t in) const;
+    bool empty() const { return runs_.empty(); }
+    const std::vector<Run> &runs() const { return runs_; }
+
+    /// Returns e.g. "9000:8000,9100-9199:8100-8199" (external:internal, as on the command line)
+    std::string toString() const;
+
+    bool operator==(const PortMap &) const = default;
+
+private:
+    std::vector<Run> runs_;
+};
+
+/// The transport protocols a port mapping may be for
+enum class Proto : uint8_t { TCP = 0, UDP = 1 };
+inline constexpr size_t NumProtos = 2;
+inline constexpr std::array<Proto, NumProtos> AllProtos = {Proto::TCP, Proto::UDP};
+/// Returns "TCP" or "UDP", as expected by the IGD's NewProtocol argument
+const char *protoName(Proto p);
+/// Parses "TCP" or "UDP" (case-insensitively), as found in the router's port mapping table
+std::optional<Proto> parseProto(std::string_view name);
+
+/// A fixed-size set covering all 65536 port numbers, one bit per port (8 KiB). Membership tests are O(1), while set
+/// operations, counting and iteration work a 64-bit word at a time. Nothing ever allocates.
+class PortBitmap
+{
+    static constexpr size_t NWords = 65536 / 64;
+    std::array<uint64_t, NWords> words{};
+
+    static constexpr uint64_t bit(uint16_t port) { return uint64_t(1) << (port % 64u); }
+public:
+    bool test(uint16_t port) const { return words[port / 64u] & bit(port); }
+    void set(uint16_t port) { words[port / 64u] |= bit(port); }
+    void reset(uint16_t port) { words[port / 64u] &= ~bit(port); }
+    void set(uint16_t port, bool val) { val ? set(port) : reset(port); }
+    /// Set all the bits in `r`, filling whole words at once where possible
+    void set(const PortSet::Range &r);
+    void clear() { words.fill(0); }
+    /// Make this bitmap contain exactly the ports in `ps`
+    void assign(const PortSet &ps) { clear(); for (const auto &r : ps.ranges()) set(r); }
+
+    size_t count() const { size_t n = 0; for (const auto w : words) n += std::popcount(w); return n; }
+    bool any() const { for (const auto w : words) if (w) return true; return false; }
+    bool none() const { return !any(); }
+
+    PortBitmap &operator|=(const PortBitmap &o) { for (size_t i = 0; i < NWords; ++i) words[i] |= o.words[i]; return *this; }
+    PortBitmap &operator&=(const PortBitmap &o) { for (size_t i = 0; i < NWords; ++i) words[i] &= o.words[i]; return *this; }
+    /// Remove all the ports in `o` from this set
+    PortBitmap &operator-=(const PortBitmap &o) { for (size_t i = 0; i < NWords; ++i) words[i] &= ~o.words[i]; return *this; }
+    friend PortBitmap operator-(PortBitmap a, const PortBitmap &b) { return a -= b; }
+    bool operator==(const PortBitmap &) const = default;
+
+    /// Returns the lowest port >= `from` in the set, or std::nullopt if there is none
+    std::optional<uint16_t> findNext(uint32_t from) const {
+        if (from >= 65536u) return std::nullopt;
+        size_t i = from / 64u;
+        uint64_t w = words[i] & (~uint64_t(0) << (from % 64u));
+        for (;;) {
+            if (w) return uint16_t(i * 64u + std::countr_zero(w));
+            if (++i >= NWords) return std::nullopt;
+            w = words[i];
+        }
+    }
+
+    /// Calls `f(port)` for each port in the set, in ascending order
+    template <typename Func>
+    void forEach(Func && f) const {
+        for (size_t i = 0; i < NWords; ++i)
+            for (uint64_t w = words[i]; w; w &= w - 1u)
+                f(uint16_t(i * 64u + std::countr_zero(w)));
+    }
+};
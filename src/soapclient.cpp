@@ -0,0 +1,746 @@
+#include "soapclient.h"
+#include "threadinterrupt.h"
+#include "util.h"
+
+#include <miniupnpc/upnpcommands.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+
+namespace {
+
+constexpr unsigned MaxStaleReuses = 3; ///< after this many dead pooled connections in a row, give up on keep-alive
+constexpr size_t MaxResponseSize = 1024 * 1024; ///< sanity limit on the size of a router's response
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+bool icontains(std::string_view haystack, std::string_view needle) {
+    for (size_t i = 0; i + needle.size() <= haystack.size(); ++i)
+        if (iequals(haystack.substr(i, needle.size()), needle)) return true;
+    return false;
+}
+
+std::string_view trim(std::string_view sv) {
+    constexpr std::string_view ws = " \t\r\n";
+    const auto b = sv.find_first_not_of(ws);
+    if (b == sv.npos) return {};
+    return sv.substr(b, sv.find_last_not_of(ws) - b + 1);
+}
+
+std::string xmlEscape(std::string_view sv) {
+    std::string ret;
+    ret.reserve(sv.size());
+    for (const char c : sv) {
+        switch (c) {
+        case '&': ret += "&amp;"; break;
+        case '<': ret += "&lt;"; break;
+        case '>': ret += "&gt;"; break;
+        case '"': ret += "&quot;"; break;
+        case '\'': ret += "&apos;"; break;
+        default: ret += c; break;
+        }
+    }
+    return ret;
+}
+
+std::string xmlUnescape(std::string_view sv) {
+    static constexpr std::pair<std::string_view, char> entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''},
+    };
+    std::string ret;
+    ret.reserve(sv.size());
+    for (size_t i = 0; i < sv.size(); ) {
+        bool found = false;
+        if (sv[i] == '&') {
+            for (const auto & [ent, c] : entities) {
+                if (sv.substr(i, ent.size()) == ent) {
+                    ret += c;
+                    i += ent.size();
+                    found = true;
+                    break;
+                }
+            }
+        }
+        if (!found) ret += sv[i++];
+    }
+    return ret;
+}
+
+/// Extracts all leaf elements (`<ns:Name>value</ns:Name>` or `<ns:Name/>`) found in `xml`, in document order, with
+/// namespace prefixes stripped and entities unescaped. This is all we need for the flat response bodies IGDs send.
+SoapClient::Args parseLeafElements(std::string_view xml) {
+    const auto stripPrefix = [](std::string_view name) {
+        if (const auto colon = name.find(':'); colon != name.npos) name.remove_prefix(colon + 1);
+        return name;
+    };
+    SoapClient::Args ret;
+    size_t pos = 0;
+    while ((pos = xml.find('<', pos)) != xml.npos) {
+        const auto end = xml.find('>', pos);
+        if (end == xml.npos) break;
+        std::string_view tag = xml.substr(pos + 1, end - pos - 1);
+        pos = end + 1;
+        if (tag.empty() || tag.front() == '/' || tag.front() == '?' || tag.front() == '!') continue;
+        const bool selfClosing = tag.back() == '/';
+        if (selfClosing) tag.remove_suffix(1);
+        const std::string_view name = tag.substr(0, tag.find_first_of(" \t\r\n"));
+        if (selfClosing) {
+            ret.emplace_back(stripPrefix(name), std::string{});
+            continue;
+        }
+        // It's a leaf iff the very next tag is the matching close tag
+        const auto next = xml.find('<', pos);
+        if (next == xml.npos) break;
+        if (xml.substr(next, 2) != "</") continue;
+        const auto closeEnd = xml.find('>', next);
+        if (closeEnd == xml.npos) break;
+        if (trim(xml.substr(next + 2, closeEnd - next - 2)) != name) continue;
+        ret.emplace_back(stripPrefix(name), xmlUnescape(xml.substr(pos, next - pos)));
+        pos = closeEnd + 1;
+    }
+    return ret;
+}
+
+template <typename T>
+bool parseUInt(std::string_view sv, T &out) {
+    sv = trim(sv);
+    const auto [p, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), out);
+    return ec == std::errc{} && p == sv.data() + sv.size();
+}
+
+/// Applies the field `name` (as named by either GetGenericPortMappingEntry or GetListOfPortMappings) to `e`. Returns
+/// false if `name` isn't one we know.
+bool setField(SoapClient::PortMappingEntry &e, std::string_view name, std::string_view value) {
+    if (name == "NewExternalPort") parseUInt(value, e.extPort);
+    else if (name == "NewInternalPort") parseUInt(value, e.inPort);
+    else if (name == "NewProtocol") e.proto = trim(value);
+    else if (name == "NewInternalClient") e.inClient = trim(value);
+    else if (name == "NewEnabled") e.enabled = trim(value) != "0";
+    else if (name == "NewPortMappingDescription" || name == "NewDescription") e.desc = value;
+    else if (name == "NewLeaseDuration" || name == "NewLeaseTime") parseUInt(value, e.leaseDuration);
+    else return false;
+    return true;
+}
+
+std::string buildRequest(const Net::HttpUrl &url, std::string_view serviceType, std::string_view action,
+                         const SoapClient::Args &args, bool keepAlive) {
+    std::string body = strprintf(
+        "<?xml version=\"1.0\"?>\r\n"
+        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+        "<s:Body><u:%s xmlns:u=\"%s\">", action, serviceType);
+    for (const auto & [name, value] : args)
+        body += strprintf("<%s>%s</%s>", name, xmlEscape(value), name);
+    body += strprintf("</u:%s></s:Body></s:Envelope>\r\n", action);
+
+    return strprintf("POST %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "User-Agent: %s/%s UPnP/1.1\r\n"
+                     "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+                     "SOAPAction: \"%s#%s\"\r\n"
+                     "Content-Length: %u\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n%s",
+                     url.path, url.hostHeader(), PACKAGE_NAME, PACKAGE_VERSION, serviceType, action, body.size(),
+                     keepAlive ? "keep-alive" : "close", body);
+}
+
+/// Incremental HTTP/1.x response parser. Feed it bytes as they arrive until done() or failed() return true.
+class HttpResponse
+{
+public:
+    int status = 0;
+    bool keepAlive = false; ///< true if the server is willing to let us reuse the connection for another request
+    std::string body;
+
+    bool done() const { return state == Done; }
+    bool failed() const { return state == Error; }
+
+    void feed(std::string_view data) {
+        buf.append(data);
+        process();
+        buf.erase(0, pos);
+        pos = 0;
+        if (buf.size() + body.size() > MaxResponseSize) state = Error;
+        // The server is sending stuff we didn't ask for -- don't trust the connection after this response
+        if (state == Done && !buf.empty()) keepAlive = false;
+    }
+
+    /// Call when the server closed the connection
+    void onEof() {
+        keepAlive = false;
+        if (state == Body && contentLength < 0) state = Done; // body was delimited by connection close
+        else if (state != Done) state = Error;
+    }
+
+private:
+    enum State { StatusLine, Headers, Body, ChunkSize, ChunkData, ChunkEnd, Trailers, Done, Error };
+    State state = StatusLine;
+    std::string buf;
+    size_t pos = 0;
+    long long contentLength = -1;
+    bool chunked = false;
+    size_t chunkLeft = 0;
+
+    bool nextLine(std::string_view &line) {
+        const auto nl = buf.find('\n', pos);
+        if (nl == buf.npos) return false;
+        line = std::string_view(buf).substr(pos, nl - pos);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        pos = nl + 1;
+        return true;
+    }
+
+    void takeBody(size_t maxBytes) {
+        const size_t n = std::min(maxBytes, buf.size() - pos);
+        body.append(buf, pos, n);
+        pos += n;
+    }
+
+    void process() {
+        std::string_view line;
+        for (;;) {
+            switch (state) {
+            case StatusLine: {
+                if (!nextLine(line)) return;
+                // e.g.: "HTTP/1.1 200 OK"
+                if (line.substr(0, 5) != "HTTP/" || line.size() < 12) { state = Error; return; }
+                keepAlive = line.substr(0, 8) == "HTTP/1.1";
+                const auto codeStr = line.substr(9, 3);
+                if (std::from_chars(codeStr.data(), codeStr.data() + codeStr.size(), status).ec != std::errc{}) {
+                    state = Error;
+                    return;
+                }
+                state = Headers;
+                break;
+            }
+            case Headers: {
+                if (!nextLine(line)) return;
+                if (line.empty()) {
+                    if (status >= 100 && status < 200) { state = StatusLine; contentLength = -1; chunked = false; }
+                    else if (chunked) state = ChunkSize;
+                    else if (contentLength >= 0) state = contentLength ? Body : Done;
+                    else if (status == 204 || status == 304) state = Done;
+                    else { state = Body; keepAlive = false; } // body delimited by connection close
+                    break;
+                }
+                const auto colon = line.find(':');
+                if (colon == line.npos) break; // ignore malformed header lines
+                const auto name = trim(line.substr(0, colon)), value = trim(line.substr(colon + 1));
+                if (iequals(name, "Content-Length")) {
+                    if (std::from_chars(value.data(), value.data() + value.size(), contentLength).ec != std::errc{}
+                            || contentLength < 0 || size_t(contentLength) > MaxResponseSize) {
+                        state = Error;
+                        return;
+                    }
+                } else if (iequals(name, "Transfer-Encoding")) {
+                    chunked = icontains(value, "chunked");
+                } else if (iequals(name, "Connection")) {
+                    if (icontains(value, "close")) keepAlive = false;
+                    else if (icontains(value, "keep-alive")) keepAlive = true;
+                }
+                break;
+            }
+            case Body:
+                if (contentLength < 0) { takeBody(buf.size() - pos); return; } // read until EOF
+                takeBody(size_t(contentLength) - body.size());
+                if (body.size() < size_t(contentLength)) return;
+                state = Done;
+                break;
+            case ChunkSize: {
+                if (!nextLine(line)) return;
+                line = trim(line.substr(0, line.find(';'))); // ignore chunk extensions
+                if (line.empty() || std::from_chars(line.data(), line.data() + line.size(), chunkLeft, 16).ec != std::errc{}
+                        || chunkLeft > MaxResponseSize) {
+                    state = Error;
+                    return;
+                }
+                state = chunkLeft ? ChunkData : Trailers;
+                break;
+            }
+            case ChunkData: {
+                const size_t before = body.size();
+                takeBody(chunkLeft);
+                chunkLeft -= body.size() - before;
+                if (chunkLeft) return;
+                state = ChunkEnd;
+                break;
+            }
+            case ChunkEnd:
+                if (!nextLine(line)) return;
+                state = line.empty() ? ChunkSize : Error;
+                break;
+            case Trailers:
+                if (!nextLine(line)) return;
+                if (line.empty()) state = Done;
+                break;
+            case Done:
+            case Error:
+                return;
+            }
+        }
+    }
+};
+
+/// Turn a complete HTTP response into a UPNPCOMMAND_* code or a UPnP errorCode, mimicking miniupnpc.
+int interpret(const HttpResponse &resp, SoapClient::Args *out) {
+    SoapClient::Args leaves = parseLeafElements(resp.body);
+    for (const auto & [name, value] : leaves) {
+        if (name != "errorCode") continue;
+        int code{};
+        if (const auto [p, ec] = std::from_chars(value.data(), value.data() + value.size(), code); ec == std::errc{} && code > 0)
+            return code;
+        return UPNPCOMMAND_UNKNOWN_ERROR;
+    }
+    if (resp.status != 200) return UPNPCOMMAND_HTTP_ERROR;
+    if (resp.body.find("Envelope") == std::string::npos) return UPNPCOMMAND_INVALID_RESPONSE;
+    if (out) *out = std::move(leaves);
+    return UPNPCOMMAND_SUCCESS;
+}
+
+} // namespace
+
+struct SoapClient::Conn
+{
+    enum State { Connecting, Busy, Idle, Closed };
+
+    Net::Socket sock;
+    State state = Connecting;
+    std::optional<Pending> req; ///< the request in flight on this connection, if any
+    bool reused = false; ///< true if `req` is not the first request sent on this connection
+    bool gotAny = false; ///< true if any part of the response to `req` has arrived
+    size_t sent = 0; ///< bytes of `req->wire` sent so far
+    HttpResponse resp;
+    Net::Clock::time_point idleSince;
+};
+
+SoapClient::SoapClient() {}
+
+SoapClient::~SoapClient() { reset(); }
+
+bool SoapClient::setup(std::string_view controlURL, std::string_view serviceType_, unsigned maxConns_)
+{
+    reset();
+    auto optUrl = Net::parseHttpUrl(controlURL);
+    if (!optUrl) return false;
+    try {
+        poller = std::make_unique<Net::Poller>();
+        waker = std::make_unique<Net::Waker>();
+        if (!poller->add(waker->fd(), Net::Poller::Readable, waker.get()))
+            throw InternalError(strprintf("SOAP: cannot poll: %s", Net::errorString(Net::lastError())));
+    } catch (const std::exception &e) {
+        Error() << e.what();
+        poller.reset();
+        waker.reset();
+        return false;
+    }
+    url = std::move(*optUrl);
+    serviceType = serviceType_;
+    maxConns = std::max(maxConns_, 1u);
+    return true;
+}
+
+void SoapClient::reset()
+{
+    abortAll();
+    if (poller && waker) poller->remove(waker->fd());
+    poller.reset();
+    waker.reset();
+    url = {};
+    serviceType.clear();
+    keepAlive = true;
+    staleReuses = 0;
+}
+
+bool SoapClient::run(const RequestSource &source, const ThreadInterrupt *interrupt, Net::Clock::time_point deadline)
+{
+    if (!poller) {
+        // not set up -- fail everything
+        for (Request r; source && source(r); )
+            if (r.done) r.done(UPNPCOMMAND_INVALID_ARGS, {});
+        return true;
+    }
+    // Have the interrupt wake us up out of poll() right away, rather than us having to check it periodically
+    std::optional<size_t> subscription;
+    if (interrupt) subscription = interrupt->subscribe([w = waker.get()] { w->notify(); });
+    Defer d([&] { if (subscription) interrupt->unsubscribe(*subscription); });
+
+    std::vector<Net::Poller::Event> events;
+    for (;;) {
+        auto now = Net::Clock::now();
+        if ((interrupt && *interrupt) || now >= deadline) {
+            abortAll();
+            return false;
+        }
+        // Expire requests that took too long, and idle connections we've had for too long
+        for (const auto &c : conns) {
+            if (c->req && now >= c->req->deadline)
+                fail(*c, UPNPCOMMAND_HTTP_ERROR, "timed out");
+            else if (c->state == Conn::Idle && now - c->idleSince >= MaxIdleTime)
+                close(*c);
+        }
+        sweep();
+
+        // Put as many requests as we are allowed on the wire
+        while (inFlight < maxConns) {
+            if (!retries.empty()) {
+                dispatch(std::move(retries.front()));
+                retries.pop_front();
+            } else if (Request r; source && source(r)) {
+                std::string wire = buildRequest(url, serviceType, r.action, r.args, keepAlive);
+                dispatch({std::move(r.action), std::move(wire), std::move(r.done), {}});
+            } else {
+                break;
+            }
+        }
+        sweep();
+        if (retries.empty() && !inFlight) return true;
+
+        // Wait for I/O, an interrupt, or until the next request deadline or idle connection expiry, whichever comes
+        // first
+        now = Net::Clock::now();
+        auto wakeAt = deadline;
+        for (const auto &c : conns) {
+            if (c->req) wakeAt = std::min(wakeAt, c->req->deadline);
+            else if (c->state == Conn::Idle) wakeAt = std::min(wakeAt, c->idleSince + MaxIdleTime);
+        }
+        if (poller->wait(events, std::chrono::ceil<std::chrono::milliseconds>(wakeAt - now)) < 0) {
+            Error("SOAP: poll failed: %s", Net::errorString(Net::lastError()));
+            abortAll();
+            return false;
+        }
+        for (const auto &ev : events) {
+            if (ev.tag == waker.get()) waker->drain(); // the interrupt is checked at the top of the loop
+            else onEvent(*static_cast<Conn *>(ev.tag), ev.events);
+        }
+        sweep();
+    }
+}
+
+void SoapClient::dispatch(Pending &&p)
+{
+    p.deadline = Net::Clock::now() + Timeout;
+    ++inFlight;
+    // Prefer an idle connection we already have open
+    for (const auto &c : conns) {
+        if (c->state != Conn::Idle) continue;
+        c->state = Conn::Busy;
+        c->req.emplace(std::move(p));
+        c->reused = true;
+        poller->modify(c->sock.get(), Net::Poller::Writable, c.get());
+        return;
+    }
+    auto c = std::make_unique<Conn>();
+    c->req.emplace(std::move(p));
+    std::string err;
+    c->sock = Net::startConnect(url.host, url.port, &err);
+    Conn &conn = *conns.emplace_back(std::move(c));
+    if (!conn.sock) {
+        fail(conn, UPNPCOMMAND_HTTP_ERROR, err);
+    } else if (!poller->add(conn.sock.get(), Net::Poller::Writable, &conn)) {
+        fail(conn, UPNPCOMMAND_HTTP_ERROR, strprintf("poller: %s", Net::errorString(Net::lastError())));
+    }
+}
+
+void SoapClient::onEvent(Conn &c, unsigned events)
+{
+    switch (c.state) {
+    case Conn::Closed:
+        break;
+    case Conn::Idle:
+        // An idle connection should never have anything to read: this is EOF, an error, or garbage.
+        close(c);
+        break;
+    case Conn::Connecting:
+        if (!(events & Net::Poller::Writable)) break;
+        if (const int err = Net::connectResult(c.sock.get())) {
+            fail(c, UPNPCOMMAND_HTTP_ERROR, strprintf("connect: %s", Net::errorString(err)));
+            break;
+        }
+        c.state = Conn::Busy;
+        trySend(c);
+        break;
+    case Conn::Busy:
+        if (c.req && c.sent < c.req->wire.size()) {
+            if (events & Net::Poller::Writable) trySend(c);
+        } else if (events & Net::Poller::Readable) {
+            tryRecv(c);
+        }
+        break;
+    }
+}
+
+void SoapClient::trySend(Conn &c)
+{
+    const std::string &wire = c.req->wire;
+    while (c.sent < wire.size()) {
+        if (const long n = Net::sendSome(c.sock.get(), wire.data() + c.sent, wire.size() - c.sent); n > 0) {
+            c.sent += size_t(n);
+        } else if (const int e = Net::lastError(); n < 0 && Net::isWouldBlock(e)) {
+            return; // wait for the next Writable event
+        } else {
+            if (!c.sent && requeueStale(c)) return;
+            fail(c, UPNPCOMMAND_HTTP_ERROR, strprintf("send: %s", Net::errorString(e)));
+            return;
+        }
+    }
+    poller->modify(c.sock.get(), Net::Poller::Readable, &c);
+}
+
+void SoapClient::tryRecv(Conn &c)
+{
+    char buf[4096];
+    for (;;) {
+        if (const long n = Net::recvSome(c.sock.get(), buf, sizeof(buf)); n > 0) {
+            c.gotAny = true;
+            c.resp.feed({buf, size_t(n)});
+            if (c.resp.failed()) return fail(c, UPNPCOMMAND_HTTP_ERROR, "malformed HTTP response");
+            if (c.resp.done()) return complete(c);
+        } else if (n == 0) {
+            c.resp.onEof();
+            if (c.resp.done()) return complete(c);
+            if (!c.gotAny && requeueStale(c)) return;
+            return fail(c, UPNPCOMMAND_HTTP_ERROR, "connection closed by router");
+        } else if (const int e = Net::lastError(); Net::isWouldBlock(e)) {
+            return; // wait for the next Readable event
+        } else {
+            return fail(c, UPNPCOMMAND_HTTP_ERROR, strprintf("recv: %s", Net::errorString(e)));
+        }
+    }
+}
+
+bool SoapClient::requeueStale(Conn &c)
+{
+    if (!c.reused || c.req->retried) return false;
+    // The router closed this pooled connection while it sat idle; resend the request on another connection.
+    c.req->retried = true;
+    retries.push_back(std::move(*c.req));
+    c.req.reset();
+    --inFlight;
+    if (++staleReuses >= MaxStaleReuses && keepAlive) {
+        keepAlive = false;
+        Debug("SOAP: %s keeps dropping idle connections, falling back to one connection per request",
+              url.hostHeader());
+    }
+    close(c);
+    return true;
+}
+
+void SoapClient::complete(Conn &c)
+{
+    Pending p = std::move(*c.req);
+    c.req.reset();
+    --inFlight;
+    Args out;
+    const int result = interpret(c.resp, &out);
+    if (c.reused) staleReuses = 0;
+    if (keepAlive && c.resp.keepAlive) {
+        // Return the connection to the idle pool
+        c.state = Conn::Idle;
+        c.reused = c.gotAny = false;
+        c.sent = 0;
+        c.resp = {};
+        c.idleSince = Net::Clock::now();
+        poller->modify(c.sock.get(), Net::Poller::Readable, &c);
+    } else {
+        if (keepAlive) {
+            keepAlive = false;
+            Debug("SOAP: %s does not support persistent connections, falling back to one connection per request",
+                  url.hostHeader());
+            for (const auto &other : conns)
+                if (other->state == Conn::Idle) close(*other);
+        }
+        close(c);
+    }
+    if (p.done) p.done(result, std::move(out));
+}
+
+void SoapClient::fail(Conn &c, int result, std::string_view why)
+{
+    std::optional<Pending> p = std::move(c.req);
+    c.req.reset();
+    close(c);
+    if (!p) return;
+    --inFlight;
+    Debug("SOAP %s to %s failed: %s", p->action, url.hostHeader(), why);
+    if (p->done) p->done(result, {});
+}
+
+void SoapClient::close(Conn &c)
+{
+    if (c.state == Conn::Closed) return;
+    if (c.sock && poller) poller->remove(c.sock.get());
+    c.sock.close();
+    c.state = Conn::Closed;
+}
+
+void SoapClient::sweep()
+{
+    std::erase_if(conns, [](const auto &c) { return c->state == Conn::Closed && !c->req; });
+}
+
+void SoapClient::abortAll()
+{
+    std::vector<Callback> aborted;
+    for (const auto &c : conns) {
+        if (c->req) {
+            aborted.push_back(std::move(c->req->done));
+            c->req.reset();
+        }
+        close(*c);
+    }
+    for (auto &p : retries)
+        aborted.push_back(std::move(p.done));
+    retries.clear();
+    conns.clear();
+    inFlight = 0;
+    for (auto &cb : aborted)
+        if (cb) cb(Aborted, {});
+}
+
+int SoapClient::call(std::string_view action, const Args &args, Args *out, const ThreadInterrupt *interrupt)
+{
+    int result = UPNPCOMMAND_UNKNOWN_ERROR;
+    bool given = false;
+    run([&](Request &r) {
+        if (std::exchange(given, true)) return false;
+        r = {std::string(action), args, [&](int res, Args &&o) {
+            result = res;
+            if (out) *out = std::move(o);
+        }};
+        return true;
+    }, interrupt);
+    return result;
+}
+
+int SoapClient::getExternalIPAddress(std::string &extIP, const ThreadInterrupt *interrupt)
+{
+    Args out;
+    const int r = call("GetExternalIPAddress", {}, &out, interrupt);
+    if (r != UPNPCOMMAND_SUCCESS) return r;
+    for (auto & [name, value] : out) {
+        if (name == "NewExternalIPAddress") {
+            extIP = std::move(value);
+            return r;
+        }
+    }
+    return UPNPCOMMAND_INVALID_RESPONSE;
+}
+
+int SoapClient::getUptime(uint32_t &uptime, const ThreadInterrupt *interrupt)
+{
+    Args out;
+    const int r = call("GetStatusInfo", {}, &out, interrupt);
+    if (r != UPNPCOMMAND_SUCCESS) return r;
+    return parseUInt(argValue(out, "NewUptime"), uptime) ? r : UPNPCOMMAND_INVALID_RESPONSE;
+}
+
+/* static */
+SoapClient::Args SoapClient::addPortMappingArgs(std::string_view extPort, std::string_view inPort,
+                                                std::string_view inClient, std::string_view desc,
+                                                std::string_view proto, std::string_view leaseDuration)
+{
+    return {
+        {"NewRemoteHost", ""},
+        {"NewExternalPort", std::string(extPort)},
+        {"NewProtocol", std::string(proto)},
+        {"NewInternalPort", std::string(inPort)},
+        {"NewInternalClient", std::string(inClient)},
+        {"NewEnabled", "1"},
+        {"NewPortMappingDescription", std::string(desc)},
+        {"NewLeaseDuration", std::string(leaseDuration)},
+    };
+}
+
+/* static */
+SoapClient::Args SoapClient::deletePortMappingArgs(std::string_view extPort, std::string_view proto)
+{
+    return {
+        {"NewRemoteHost", ""},
+        {"NewExternalPort", std::string(extPort)},
+        {"NewProtocol", std::string(proto)},
+    };
+}
+
+/* static */
+SoapClient::Args SoapClient::deletePortMappingRangeArgs(uint16_t startPort, uint16_t endPort, std::string_view proto)
+{
+    return {
+        {"NewStartPort", strprintf("%u", startPort)},
+        {"NewEndPort", strprintf("%u", endPort)},
+        {"NewProtocol", std::string(proto)},
+        {"NewManage", "0"}, // only mappings of ours
+    };
+}
+
+/* static */
+SoapClient::Args SoapClient::getSpecificPortMappingEntryArgs(std::string_view extPort, std::string_view proto)
+{
+    return deletePortMappingArgs(extPort, proto); // same arguments
+}
+
+/* static */
+SoapClient::Args SoapClient::getGenericPortMappingEntryArgs(unsigned index)
+{
+    return {{"NewPortMappingIndex", strprintf("%u", index)}};
+}
+
+/* static */
+SoapClient::Args SoapClient::getListOfPortMappingsArgs(uint16_t startPort, uint16_t endPort, std::string_view proto,
+                                                       unsigned count)
+{
+    return {
+        {"NewStartPort", strprintf("%u", startPort)},
+        {"NewEndPort", strprintf("%u", endPort)},
+        {"NewProtocol", std::string(proto)},
+        {"NewManage", "1"}, // all mappings, not just those of the requesting host (we filter them ourselves)
+        {"NewNumberOfPorts", strprintf("%u", count)},
+    };
+}
+
+/* static */
+std::string_view SoapClient::argValue(const Args &args, std::string_view name)
+{
+    for (const auto & [n, value] : args)
+        if (n == name) return value;
+    return {};
+}
+
+/* static */
+SoapClient::PortMappingEntry SoapClient::portMappingEntry(const Args &out)
+{
+    PortMappingEntry ret;
+    for (const auto & [name, value] : out)
+        setField(ret, name, value);
+    return ret;
+}
+
+/* static */
+std::vector<SoapClient::PortMappingEntry> SoapClient::parsePortListing(const Args &out)
+{
+    // The listing normally comes as an escaped XML document in NewPortListing, but some routers embed it raw or as
+    // CDATA, in which case its leaf elements end up directly in `out`.
+    const auto listing = argValue(out, "NewPortListing");
+    const Args leaves = listing.empty() ? out : parseLeafElements(listing);
+    // The listing is a flat sequence of <PortMappingEntry> elements, each holding the same set of leaf elements. We
+    // don't track the nesting; instead, a field we have already seen marks the start of the next entry.
+    std::vector<PortMappingEntry> ret;
+    PortMappingEntry cur;
+    std::vector<std::string_view> seen;
+    for (const auto & [name, value] : leaves) {
+        if (std::find(seen.begin(), seen.end(), name) != seen.end()) {
+            if (cur.extPort) ret.push_back(std::move(cur));
+            cur = {};
+            seen.clear();
+        }
+        if (setField(cur, name, value)) seen.push_back(name);
+    }
+    if (cur.extPort) ret.push_back(std::move(cur));
+    return ret;
+}
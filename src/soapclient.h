@@ -0,0 +1,144 @@
+#pragma once
+
+#include "netutil.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class ThreadInterrupt;
+
+/// A minimal, non-blocking SOAP-over-HTTP/1.1 client for the control URL of a UPnP IGD.
+///
+/// Requests are pulled from a caller-supplied RequestSource and multiplexed over up to `maxConns` connections by a
+/// single-threaded event loop (epoll on Linux, poll() elsewhere), so that many requests may be in flight at once
+/// without any one slow response holding up the others. Each request has its own timeout, and completes by invoking
+/// its callback from within run().
+///
+/// Connections are HTTP/1.1 keep-alive and are reused for subsequent requests (and subsequent calls to run()) until
+/// they have sat idle for MaxIdleTime. Routers that close the connection after every response are detected, after
+/// which we fall back to one connection per request.
+///
+/// Results are UPNPCOMMAND_SUCCESS, one of the negative UPNPCOMMAND_* error codes, or the positive UPnP errorCode sent
+/// back by the router -- exactly like the miniupnpc UPNP_* functions -- so that they can be passed to strupnperror().
+/// This class is not thread-safe.
+class SoapClient
+{
+public:
+    using Args = std::vector<std::pair<std::string, std::string>>;
+    /// Called when a request completes. `out` holds the response arguments if `result` == UPNPCOMMAND_SUCCESS.
+    using Callback = std::function<void(int result, Args &&out)>;
+
+    struct Request {
+        std::string action;
+        Args args;
+        Callback done;
+    };
+    /// Fills in `req` and returns true, or returns false if there are no more requests to send right now. The source is
+    /// polled again whenever a request completes, so a callback may queue follow-up requests for it to hand out.
+    using RequestSource = std::function<bool(Request &req)>;
+
+    /// Result passed to the callbacks of requests that were still in flight when run() was interrupted. The router
+    /// may or may not have acted on such requests.
+    static constexpr int Aborted = -100;
+
+    /// Timeout for each request, counted from when it is put on the wire (including any connect)
+    static constexpr std::chrono::milliseconds Timeout{5000};
+    /// Pooled connections idle for longer than this are closed rather than reused (routers drop them anyway)
+    static constexpr std::chrono::seconds MaxIdleTime{15};
+
+    SoapClient();
+    ~SoapClient();
+
+    /// (Re)initialize to talk to `controlURL` using `serviceType`, closing any open connections. At most `maxConns`
+    /// requests (and thus connections) are in flight at once. Returns false if `controlURL` could not be parsed.
+    bool setup(std::string_view controlURL, std::string_view serviceType, unsigned maxConns);
+    /// Close all connections and forget the control URL.
+    void reset();
+
+    /// Send all the requests produced by `source`, returning once all of them have completed and the source has
+    /// nothing more to send. If `interrupt` is specified and becomes set, or `deadline` passes, we stop early:
+    /// requests still in flight complete with `Aborted`, and false is returned.
+    bool run(const RequestSource &source, const ThreadInterrupt *interrupt = nullptr,
+             Net::Clock::time_point deadline = Net::Clock::time_point::max());
+
+    /// Synchronous convenience wrapper around run() for a single request.
+    int call(std::string_view action, const Args &args, Args *out = nullptr, const ThreadInterrupt *interrupt = nullptr);
+
+    // Argument lists for the WANIPConnection actions we use
+    static Args addPortMappingArgs(std::string_view extPort, std::string_view inPort, std::string_view inClient,
+                                   std::string_view desc, std::string_view proto, std::string_view leaseDuration);
+    static Args deletePortMappingArgs(std::string_view extPort, std::string_view proto);
+    static Args deletePortMappingRangeArgs(uint16_t startPort, uint16_t endPort, std::string_view proto);
+    static Args getSpecificPortMappingEntryArgs(std::string_view extPort, std::string_view proto);
+    static Args getGenericPortMappingEntryArgs(unsigned index);
+    static Args getListOfPortMappingsArgs(uint16_t startPort, uint16_t endPort, std::string_view proto, unsigned count);
+    /// Returns the value of the response argument `name` in `args`, or an empty string if it is absent
+    static std::string_view argValue(const Args &args, std::string_view name);
+
+    /// One entry of the router's port mapping table
+    struct PortMappingEntry {
+        uint16_t extPort = 0, inPort = 0;
+        std::string proto, inClient, desc;
+        bool enabled = true;
+        unsigned leaseDuration = 0; ///< seconds remaining, or 0 for a permanent mapping
+    };
+    /// Converts the response arguments of GetGenericPortMappingEntry or GetSpecificPortMappingEntry (the latter
+    /// doesn't include the external port and protocol, which are then left as-is).
+    static PortMappingEntry portMappingEntry(const Args &out);
+    /// Extracts the entries from the response arguments of GetListOfPortMappings (IGDv2)
+    static std::vector<PortMappingEntry> parsePortListing(const Args &out);
+
+    int getExternalIPAddress(std::string &extIP, const ThreadInterrupt *interrupt = nullptr);
+    /// Gets NewUptime from GetStatusInfo: how long, in seconds, the router says its WAN connection has been up
+    int getUptime(uint32_t &uptime, const ThreadInterrupt *interrupt = nullptr);
+
+    /// Returns false once we have concluded that the router won't let us reuse connections.
+    bool usingKeepAlive() const { return keepAlive; }
+
+private:
+    struct Pending {
+        std::string action;
+        std::string wire; ///< the complete HTTP request
+        Callback done;
+        Net::Clock::time_point deadline;
+        bool retried = false;
+    };
+    struct Conn;
+
+    Net::HttpUrl url;
+    std::string serviceType;
+    unsigned maxConns = 1;
+
+    std::unique_ptr<Net::Poller> poller;
+    std::unique_ptr<Net::Waker> waker; ///< registered with `poller`, so that an interrupt can wake up run()
+    std::vector<std::unique_ptr<Conn>> conns; ///< all open connections, both busy and idle
+    std::deque<Pending> retries; ///< requests whose pooled connection turned out to be dead, to be resent
+    unsigned inFlight = 0;
+
+    bool keepAlive = true;
+    unsigned staleReuses = 0; ///< number of consecutive reused connections that turned out to be dead
+
+    void dispatch(Pending &&p);
+    void onEvent(Conn &c, unsigned events);
+    void trySend(Conn &c);
+    void tryRecv(Conn &c);
+    /// Finish the request on `c` with a complete response from the router
+    void complete(Conn &c);
+    /// If `c` is a pooled connection the router has closed under us, queue its request to be resent on another
+    /// connection and return true.
+    bool requeueStale(Conn &c);
+    /// Finish the request on `c` (if any) with `result`, and close the connection
+    void fail(Conn &c, int result, std::string_view why);
+    void close(Conn &c);
+    /// Delete closed connections
+    void sweep();
+    void abortAll();
+};
@@ -0,0 +1,263 @@
+#include "ssdp.h"
+#include "netutil.h"
+#include "threadinterrupt.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <memory>
+#include <optional>
+
+#if WINDOWS
+#  define WIN32_LEAN_AND_MEAN 1
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#else
+#  include <arpa/inet.h>
+#  include <netinet/in.h>
+#  include <sys/socket.h>
+#endif
+
+namespace Ssdp {
+
+namespace {
+constexpr const char *MulticastAddr = "239.255.255.250";
+constexpr uint16_t Port = 1900;
+
+bool iequals(std::string_view a, std::string_view b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+std::string_view trim(std::string_view sv) {
+    while (!sv.empty() && std::isspace(static_cast<unsigned char>(sv.front()))) sv.remove_prefix(1);
+    while (!sv.empty() && std::isspace(static_cast<unsigned char>(sv.back()))) sv.remove_suffix(1);
+    return sv;
+}
+
+/// Calls `f(name, value)` for each header line of the HTTP-like message `msg`, skipping its start line
+template <typename Func>
+void forEachHeader(std::string_view msg, Func && f) {
+    for (auto eol = msg.find("\r\n"); eol != msg.npos; ) {
+        msg.remove_prefix(eol + 2);
+        eol = msg.find("\r\n");
+        const std::string_view line = msg.substr(0, eol);
+        if (line.empty()) break;
+        const auto colon = line.find(':');
+        if (colon == line.npos) continue;
+        f(trim(line.substr(0, colon)), trim(line.substr(colon + 1)));
+    }
+}
+
+std::optional<uint32_t> parseUInt(std::string_view sv) {
+    uint32_t ret{};
+    const auto [end, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), ret);
+    if (ec != std::errc{} || end != sv.data() + sv.size()) return std::nullopt;
+    return ret;
+}
+
+/// Opens a non-blocking UDP socket that sends multicasts out of the interface with address `ifAddr` (host byte order),
+/// or out of the default interface if `ifAddr` is 0. Returns an invalid Socket on failure.
+Net::Socket openSocket(uint32_t ifAddr) {
+    Net::Socket sock(::socket(AF_INET, SOCK_DGRAM, 0));
+    if (!sock || !Net::setNonBlocking(sock.get())) return {};
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(ifAddr);
+    if (::bind(sock.get(), reinterpret_cast<const sockaddr *>(&local), sizeof(local)) != 0) return {};
+    if (ifAddr) {
+        in_addr iface{};
+        iface.s_addr = htonl(ifAddr);
+        if (::setsockopt(sock.get(), IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char *>(&iface),
+                         sizeof(iface)) != 0)
+            return {};
+    }
+    // The spec asks for a TTL of 2 (routers are normally 1 hop away anyway)
+    const int ttl = 2;
+    ::setsockopt(sock.get(), IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char *>(&ttl), sizeof(ttl));
+    return sock;
+}
+} // namespace
+
+std::optional<Response> parseResponse(std::string_view msg) {
+    // Status line, then headers, just like HTTP
+    auto eol = msg.find("\r\n");
+    const std::string_view status = msg.substr(0, eol);
+    if (!status.starts_with("HTTP/1.") || status.find(" 200") == status.npos) return std::nullopt;
+    Response ret;
+    forEachHeader(msg, [&](std::string_view name, std::string_view value) {
+        if (iequals(name, "LOCATION")) ret.location = value;
+        else if (iequals(name, "ST")) ret.st = value;
+        else if (iequals(name, "USN")) ret.usn = value;
+    });
+    if (ret.location.empty()) return std::nullopt;
+    return ret;
+}
+
+std::optional<Notify> parseNotify(std::string_view msg) {
+    if (!msg.starts_with("NOTIFY * HTTP/1.")) return std::nullopt;
+    Notify ret;
+    std::string_view nts;
+    forEachHeader(msg, [&](std::string_view name, std::string_view value) {
+        if (iequals(name, "NTS")) nts = value;
+        else if (iequals(name, "LOCATION")) ret.location = value;
+        else if (iequals(name, "NT")) ret.nt = value;
+        else if (iequals(name, "USN")) ret.usn = value;
+        else if (iequals(name, "BOOTID.UPNP.ORG")) ret.bootId = parseUInt(value);
+        else if (iequals(name, "CONFIGID.UPNP.ORG")) ret.configId = parseUInt(value);
+        else if (iequals(name, "NEXTBOOTID.UPNP.ORG")) ret.nextBootId = parseUInt(value);
+    });
+    if (nts == "ssdp:alive") ret.kind = Notify::Alive;
+    else if (nts == "ssdp:byebye") ret.kind = Notify::ByeBye;
+    else if (nts == "ssdp:update") ret.kind = Notify::Update;
+    else return std::nullopt;
+    if (ret.nt.empty() || (ret.kind != Notify::ByeBye && ret.location.empty())) return std::nullopt;
+    return ret;
+}
+
+bool isIgd(const Response &resp) {
+    return std::any_of(std::begin(IgdTargets), std::end(IgdTargets), [&](std::string_view t) {
+        return resp.st == t || resp.usn.ends_with(t);
+    });
+}
+
+bool search(const std::vector<std::string_view> &targets, std::chrono::milliseconds timeout,
+            const std::function<bool(const Response &)> &onResponse, const ThreadInterrupt *interrupt) {
+    const auto t0 = Net::Clock::now(), deadline = t0 + timeout;
+    std::vector<uint32_t> ifs = Net::multicastInterfaces();
+    if (ifs.empty()) ifs.push_back(0); // let the OS pick
+
+    sockaddr_in dest{};
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(Port);
+    ::inet_pton(AF_INET, MulticastAddr, &dest.sin_addr);
+
+    // Devices delay their answers by a random amount of up to MX seconds, to avoid flooding the network. We ask for
+    // the minimum, 1 second: there are only ever a few devices on a home network, and we want the first one fast.
+    std::vector<std::string> msgs;
+    for (const auto &st : targets)
+        msgs.push_back(strprintf("M-SEARCH * HTTP/1.1\r\nHOST: %s:%u\r\nMAN: \"ssdp:discover\"\r\nMX: 1\r\nST: %s\r\n\r\n",
+                                 MulticastAddr, Port, st));
+
+    std::optional<Net::Poller> optPoller;
+    std::optional<Net::Waker> optWaker;
+    try {
+        optPoller.emplace();
+        optWaker.emplace();
+    } catch (const InternalError &e) {
+        Error() << "SSDP: " << e.what();
+        return false;
+    }
+    Net::Poller &poller = *optPoller;
+    Net::Waker &waker = *optWaker;
+    poller.add(waker.fd(), Net::Poller::Readable, &waker);
+    std::vector<Net::Socket> socks;
+    for (const uint32_t ifAddr : ifs) {
+        Net::Socket sock = openSocket(ifAddr);
+        if (!sock) {
+            Debug("SSDP: can't search from %s: %s", Net::formatIPv4(ifAddr), Net::errorString(Net::lastError()));
+            continue;
+        }
+        bool sent = false;
+        for (const auto &msg : msgs)
+            sent |= ::sendto(sock.get(), msg.data(), int(msg.size()), 0, reinterpret_cast<const sockaddr *>(&dest),
+                             sizeof(dest)) == long(msg.size());
+        if (!sent || !poller.add(sock.get(), Net::Poller::Readable, nullptr)) continue;
+        socks.push_back(std::move(sock));
+    }
+    Defer d([&]{ for (const auto &s : socks) poller.remove(s.get()); poller.remove(waker.fd()); });
+    if (socks.empty()) return false;
+
+    std::optional<size_t> subscription;
+    if (interrupt) subscription = interrupt->subscribe([&waker] { waker.notify(); });
+    Defer d2([&] { if (subscription) interrupt->unsubscribe(*subscription); });
+
+    std::vector<std::string> seen; // LOCATIONs already handed to onResponse
+    std::vector<Net::Poller::Event> events;
+    char buf[2048];
+    for (auto now = Net::Clock::now(); now < deadline && !(interrupt && *interrupt); now = Net::Clock::now()) {
+        if (poller.wait(events, std::chrono::ceil<std::chrono::milliseconds>(deadline - now)) < 0) return true;
+        for (const auto &ev : events) {
+            if (ev.tag == &waker) waker.drain(); // the interrupt is checked at the top of the loop
+        }
+        // Responses are few and small: just drain every socket, rather than working out which ones are readable
+        for (const auto &s : socks) {
+            for (long n; (n = Net::recvSome(s.get(), buf, sizeof(buf))) > 0; ) {
+                auto resp = parseResponse(std::string_view(buf, size_t(n)));
+                if (!resp || std::find(seen.begin(), seen.end(), resp->location) != seen.end()) continue;
+                seen.push_back(resp->location);
+                resp->latency = Net::Clock::now() - t0;
+                if (onResponse(*resp)) return true;
+                if (interrupt && *interrupt) return true;
+            }
+        }
+    }
+    return true;
+}
+
+bool listen(const std::function<void(const Notify &)> &onNotify, const ThreadInterrupt &interrupt) {
+    Net::Socket sock(::socket(AF_INET, SOCK_DGRAM, 0));
+    if (!sock || !Net::setNonBlocking(sock.get())) return false;
+    // Share the port with anything else listening for announcements on this host (minissdpd, a media server...)
+    const int one = 1;
+    ::setsockopt(sock.get(), SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&one), sizeof(one));
+#ifdef SO_REUSEPORT
+    ::setsockopt(sock.get(), SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&one), sizeof(one));
+#endif
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(Port);
+    if (::bind(sock.get(), reinterpret_cast<const sockaddr *>(&local), sizeof(local)) != 0) {
+        Debug("SSDP: can't listen on port %u: %s", Port, Net::errorString(Net::lastError()));
+        return false;
+    }
+    std::vector<uint32_t> ifs = Net::multicastInterfaces();
+    if (ifs.empty()) ifs.push_back(0); // let the OS pick
+    size_t joined = 0;
+    for (const uint32_t ifAddr : ifs) {
+        ip_mreq mreq{};
+        ::inet_pton(AF_INET, MulticastAddr, &mreq.imr_multiaddr);
+        mreq.imr_interface.s_addr = htonl(ifAddr);
+        if (::setsockopt(sock.get(), IPPROTO_IP, IP_ADD_MEMBERSHIP, reinterpret_cast<const char *>(&mreq),
+                         sizeof(mreq)) == 0)
+            ++joined;
+        else
+            Debug("SSDP: can't listen on %s: %s", Net::formatIPv4(ifAddr), Net::errorString(Net::lastError()));
+    }
+    if (!joined) return false;
+
+    std::optional<Net::Poller> optPoller;
+    std::optional<Net::Waker> optWaker;
+    try {
+        optPoller.emplace();
+        optWaker.emplace();
+    } catch (const InternalError &e) {
+        Error() << "SSDP: " << e.what();
+        return false;
+    }
+    Net::Poller &poller = *optPoller;
+    Net::Waker &waker = *optWaker;
+    if (!poller.add(waker.fd(), Net::Poller::Readable, &waker) || !poller.add(sock.get(), Net::Poller::Readable, nullptr))
+        return false;
+    Defer d([&]{ poller.remove(sock.get()); poller.remove(waker.fd()); });
+    const size_t subscription = interrupt.subscribe([&waker] { waker.notify(); });
+    Defer d2([&] { interrupt.unsubscribe(subscription); });
+
+    std::vector<Net::Poller::Event> events;
+    char buf[2048];
+    while (!interrupt) {
+        if (poller.wait(events, std::chrono::minutes{1}) < 0) break;
+        for (const auto &ev : events) {
+            if (ev.tag == &waker) waker.drain(); // the interrupt is checked at the top of the loop
+        }
+        for (long n; (n = Net::recvSome(sock.get(), buf, sizeof(buf))) > 0; ) {
+            // We also get everyone's M-SEARCHes, which parseNotify() rejects
+            if (const auto notify = parseNotify(std::string_view(buf, size_t(n)))) onNotify(*notify);
+        }
+    }
+    return true;
+}
+
+} // namespace Ssdp
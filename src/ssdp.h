@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class ThreadInterrupt;
+
+/// A native implementation of the search half of SSDP, the discovery protocol of UPnP. Unlike upnpDiscover(), which
+/// always waits out its whole delay, this hands each response to the caller as it arrives, so that the caller can stop
+/// as soon as it has found what it is looking for.
+namespace Ssdp {
+
+/// The search targets for the devices and services we can use
+inline constexpr std::string_view IgdTargets[] = {
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:2",
+    "urn:schemas-upnp-org:device:InternetGatewayDevice:1",
+    "urn:schemas-upnp-org:service:WANIPConnection:2",
+    "urn:schemas-upnp-org:service:WANIPConnection:1",
+};
+
+struct Response {
+    std::string location; ///< URL of the device's root description
+    std::string st;       ///< the search target it answered
+    std::string usn;      ///< unique service name, e.g. "uuid:...::urn:schemas-upnp-org:device:InternetGatewayDevice:1"
+    std::chrono::steady_clock::duration latency{}; ///< time from sending the search to receiving this (set by search())
+};
+
+/// An announcement multicast by a device (a NOTIFY): when it comes up (and periodically after), goes away, or changes
+/// address
+struct Notify {
+    enum Kind { Alive, ByeBye, Update };
+    Kind kind = Alive;
+    std::string location; ///< URL of the device's root description (not sent with ByeBye)
+    std::string nt;       ///< notification type: what the announcement is for, like the ST of a Response
+    std::string usn;
+    /// UPnP 1.1 devices number their boots, and their configurations (the descriptions they serve). An Update announces
+    /// that the boot id is about to change to `nextBootId` without a reboot.
+    std::optional<uint32_t> bootId, configId, nextBootId;
+};
+
+/// Returns true if `resp` is from one of the IgdTargets, judging by its ST and USN. Plenty of devices (TVs, printers,
+/// NASes...) answer searches for things they aren't, and this weeds them out without fetching their descriptions.
+bool isIgd(const Response &resp);
+
+/// Parses the response to an M-SEARCH. Returns std::nullopt if `msg` isn't one, or lacks a LOCATION.
+std::optional<Response> parseResponse(std::string_view msg);
+
+/// Parses an announcement. Returns std::nullopt if `msg` isn't one.
+std::optional<Notify> parseNotify(std::string_view msg);
+
+/// Multicasts an M-SEARCH for each of `targets` out of every IPv4 interface that supports multicast (or just the
+/// default one, where interfaces can't be enumerated), then calls `onResponse` with each response for a LOCATION not
+/// seen before, as it arrives. Stops as soon as `onResponse` returns true, `timeout` has passed, or `interrupt` (if
+/// specified) is set. Returns false if no search could be sent at all.
+bool search(const std::vector<std::string_view> &targets, std::chrono::milliseconds timeout,
+            const std::function<bool(const Response &)> &onResponse, const ThreadInterrupt *interrupt = nullptr);
+
+/// Listens for the announcements devices multicast on every IPv4 interface that supports multicast (or on the default
+/// one), calling `onNotify` with each as it arrives, until `interrupt` is set. Returns false, right away, if we can't
+/// listen (say, because something else has the SSDP port to itself).
+bool listen(const std::function<void(const Notify &)> &onNotify, const ThreadInterrupt &interrupt);
+
+} // namespace Ssdp
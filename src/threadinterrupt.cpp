@@ -8,6 +8,7 @@ void ThreadInterrupt::operator()() {
     {
         std::unique_lock l(mut);
         flag.store(true, std::memory_order_release);
+        for (const auto & [id, cb] : subscribers) cb();
     }
     cond.notify_all();
 }
@@ -24,3 +25,14 @@ bool ThreadInterrupt::wait(std::optional<std::chrono::milliseconds> rel_time) co
         return predicate(); // should always be true here
     }
 }
+
+size_t ThreadInterrupt::subscribe(std::function<void()> cb) const {
+    std::unique_lock l(mut);
+    subscribers.emplace_back(nextId, std::move(cb));
+    return nextId++;
+}
+
+void ThreadInterrupt::unsubscribe(size_t id) const {
+    std::unique_lock l(mut);
+    std::erase_if(subscribers, [id](const auto &p) { return p.first == id; });
+}
@@ -3,8 +3,12 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <functional>
 #include <mutex>
 #include <optional>
+#include <utility>
+#include <vector>
 
 /**
  * A helper class for interruptible sleeps. Calling operator() will interrupt
@@ -15,6 +19,8 @@ class ThreadInterrupt {
     mutable std::condition_variable cond;
     mutable std::mutex mut;
     std::atomic<bool> flag = false;
+    mutable std::vector<std::pair<size_t, std::function<void()>>> subscribers;
+    mutable size_t nextId = 0;
 public:
     // If true, interrupt flag is set
     explicit operator bool() const;
@@ -26,4 +32,10 @@ public:
     // indefinitely.
     // @return `true` if the interrupt flag was set, `false` otherwise.
     bool wait(std::optional<std::chrono::milliseconds> timeout = std::nullopt) const;
+    // Register `cb` to be called whenever the interrupt flag gets set, from the thread setting it. This is for
+    // waking up threads that are blocked in something other than wait(), such as poll(). `cb` must be quick and
+    // must not call back into this object.
+    // @return an id to pass to unsubscribe() once `cb` may no longer be called.
+    size_t subscribe(std::function<void()> cb) const;
+    void unsubscribe(size_t id) const;
 };
@@ -1,4 +1,8 @@
 #include "upnpmgr.h"
+#include "netutil.h"
+#include "netwatch.h"
+#include "soapclient.h"
+#include "ssdp.h"
 #include "util.h"
 
 #include <miniupnpc/miniupnpc.h>
@@ -6,28 +10,904 @@
 #include <miniupnpc/upnperrors.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
-#include <set>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+namespace {
+using ProtoBitmaps = std::array<PortBitmap, NumProtos>; ///< indexed by Proto
+
+/// Walks all the (protocol, port) pairs in a ProtoBitmaps in ascending order, one per call.
+class BitmapCursor
+{
+    const ProtoBitmaps *bitmaps;
+    size_t proto = 0;
+    uint32_t next = 0;
+public:
+    explicit BitmapCursor(const ProtoBitmaps &bm) : bitmaps(&bm) {}
+    /// Returns false once all pairs have been visited
+    bool operator()(Proto &p, uint16_t &port) {
+        for ( ; proto < NumProtos; ++proto, next = 0) {
+            if (const auto found = (*bitmaps)[proto].findNext(next)) {
+                p = Proto(proto);
+                port = *found;
+                next = uint32_t(*found) + 1u;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+bool anySet(const ProtoBitmaps &bm) {
+    return std::any_of(bm.begin(), bm.end(), [](const PortBitmap &b) { return b.any(); });
+}
+
+size_t countSet(const ProtoBitmaps &bm) {
+    size_t n = 0;
+    for (const auto &b : bm) n += b.count();
+    return n;
+}
+
+using Clock = std::chrono::steady_clock;
+
+/// A point in time at which a mapping is due to be renewed or retried
+struct Deadline {
+    Clock::time_point due;
+    Proto proto;
+    uint16_t port;
+    bool operator>(const Deadline &o) const { return due > o.due; }
+};
+/// Min-heap of deadlines: top() is the mapping due soonest
+using DeadlineQueue = std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>>;
+
+/// Returns how long from now a mapping just made with `lease` should be renewed. We renew at a random point between
+/// 75% and 90% of the lease (or of `refresh`, for permanent mappings) so that mappings created together drift apart,
+/// spreading the renewal traffic out.
+Clock::duration renewalDelay(std::chrono::seconds lease, std::mt19937 &rng,
+                             Clock::duration refresh = UpnpMgr::RefreshInterval) {
+    const Clock::duration period = lease.count() ? Clock::duration(lease) : refresh;
+    std::uniform_int_distribution<Clock::rep> dist(period.count() * 3 / 4, period.count() * 9 / 10);
+    return Clock::duration(dist(rng));
+}
+
+/// Exponential backoff with "decorrelated jitter": each delay is drawn uniformly from [base, 3 * the previous delay],
+/// and capped. Consecutive failures thus back off quickly, while the randomness keeps the retries of mappings that
+/// failed together from staying in lockstep.
+class Backoff
+{
+    Clock::duration delay{};
+public:
+    Clock::duration next(Clock::duration base, Clock::duration cap, std::mt19937 &rng) {
+        const auto hi = std::max(base, 3 * delay);
+        std::uniform_int_distribution<Clock::rep> dist(base.count(), hi.count());
+        delay = std::min(cap, Clock::duration(dist(rng)));
+        return delay;
+    }
+    void reset() { delay = {}; }
+};
+
+/// How to react to a failed request
+enum class ErrorClass {
+    Transient, ///< might succeed later by itself: retry with backoff
+    Permanent, ///< the router will keep refusing: park the mapping until something changes
+};
+
+struct ErrorInfo {
+    int code;
+    ErrorClass cls;
+    const char *name;
+};
+
+/// Classification of the results we may get from the router (UPnP errorCodes from the IGD specs, plus our own
+/// negative codes for transport-level failures). Codes not listed are assumed to be transient.
+constexpr ErrorInfo errorTable[] = {
+    {SoapClient::Aborted, ErrorClass::Transient, "Aborted"},
+    {UPNPCOMMAND_UNKNOWN_ERROR, ErrorClass::Transient, "UnknownError"},
+    {UPNPCOMMAND_HTTP_ERROR, ErrorClass::Transient, "HTTPError"}, // timeouts, connection failures and HTTP errors
+    {UPNPCOMMAND_INVALID_RESPONSE, ErrorClass::Transient, "InvalidResponse"},
+    {401, ErrorClass::Permanent, "InvalidAction"},
+    {402, ErrorClass::Permanent, "InvalidArgs"},
+    {501, ErrorClass::Transient, "ActionFailed"},
+    {602, ErrorClass::Permanent, "OptionalActionNotImplemented"},
+    {606, ErrorClass::Permanent, "ActionNotAuthorized"},
+    {715, ErrorClass::Permanent, "WildCardNotPermittedInSrcIP"},
+    {716, ErrorClass::Permanent, "WildCardNotPermittedInExtPort"},
+    {718, ErrorClass::Permanent, "ConflictInMappingEntry"},
+    {724, ErrorClass::Permanent, "SamePortValuesRequired"},
+    {725, ErrorClass::Permanent, "OnlyPermanentLeasesSupported"},
+    {726, ErrorClass::Permanent, "RemoteHostOnlySupportsWildcard"},
+    {727, ErrorClass::Permanent, "ExternalPortOnlySupportsWildcard"},
+    {728, ErrorClass::Transient, "NoPortMapsAvailable"}, // the table is full, but entries may expire
+    {729, ErrorClass::Permanent, "ConflictWithOtherMechanisms"},
+    {732, ErrorClass::Permanent, "WildCardNotPermittedInIntPort"},
+};
+
+const ErrorInfo *findError(int code) {
+    const auto it = std::find_if(std::begin(errorTable), std::end(errorTable),
+                                 [code](const ErrorInfo &e) { return e.code == code; });
+    return it != std::end(errorTable) ? it : nullptr;
+}
+
+ErrorClass classifyError(int code) {
+    const ErrorInfo *e = findError(code);
+    return e ? e->cls : ErrorClass::Transient;
+}
+
+/// Like strupnperror(), but never returns nullptr (which strupnperror() does for codes it doesn't know)
+const char *errorName(int code) {
+    if (const ErrorInfo *e = findError(code)) return e->name;
+    const char *s = strupnperror(code);
+    return s ? s : "UnknownError";
+}
+
+/// Returns true if a mapping the router reports as having `left` seconds of its lease remaining (0 meaning permanent)
+/// can be kept as-is, given that we want leases of `lease`, rather than having to be re-added.
+bool leaseFresh(unsigned left, std::chrono::seconds lease) {
+    return lease.count() ? left > lease.count() / 2 : !left;
+}
+
+constexpr unsigned ListPageSize = 1000; ///< entries to ask for per GetListOfPortMappings call
+constexpr unsigned MaxTableEntries = 2 * 65536; ///< give up paging through a router's table after this many entries
+constexpr std::chrono::milliseconds HelperGrace{200}; ///< how long stop() waits for abandoned helpers (see Helpers)
+
+/// The helper threads that blocking miniupnpc calls run on, so that we can stop waiting for them. Those calls can't be
+/// cancelled, so a helper may well still be running when the program exits. That is why it and the statics the
+/// helpers use (DescCache::instance(), AdaptiveTimeout::ssdp() and desc()) are never destroyed. Thread-safe.
+class Helpers
+{
+public:
+    static Helpers &instance() {
+        static Helpers *const h = new Helpers; // never destroyed, see above
+        return *h;
+    }
+
+    template <typename Func>
+    void spawn(Func f) {
+        auto done = std::make_shared<bool>(false);
+        std::unique_lock l(mut);
+        reapLocked(); // as we go, to keep the list short
+        threads.push_back({std::thread([this, f = std::move(f), done]() mutable {
+            f();
+            std::unique_lock l(mut);
+            *done = true;
+            cond.notify_all();
+        }), std::move(done)});
+    }
+
+    /// Waits up to `timeout` for the helpers to finish, and returns how many are still running. Those are left to
+    /// finish on their own.
+    size_t joinFor(std::chrono::milliseconds timeout) {
+        std::unique_lock l(mut);
+        cond.wait_for(l, timeout, [this] {
+            return std::all_of(threads.begin(), threads.end(), [](const Helper &h) { return *h.done; });
+        });
+        reapLocked();
+        return threads.size();
+    }
+
+private:
+    struct Helper {
+        std::thread thread;
+        std::shared_ptr<bool> done; ///< guarded by `mut`
+    };
+    std::mutex mut;
+    std::condition_variable cond;
+    std::vector<Helper> threads;
+
+    Helpers() = default;
+    /// Joins the helpers that are done. Those have already let go of `mut`, or are about to, so this can't deadlock.
+    void reapLocked() {
+        std::erase_if(threads, [](Helper &h) {
+            if (!*h.done) return false;
+            h.thread.join();
+            return true;
+        });
+    }
+};
+
+/// Runs `f` on a helper thread and waits for its result. This is for miniupnpc calls that block and can't be
+/// cancelled: if `interrupt` gets set first, we stop waiting and return std::nullopt, leaving the helper to finish on
+/// its own (see Helpers). So `f` must be self-contained, and its result must own whatever it refers to.
+template <typename Func>
+auto runInterruptible(const ThreadInterrupt &interrupt, Func f) -> std::optional<decltype(f())> {
+    using Result = decltype(f());
+    struct State {
+        std::mutex mut;
+        std::condition_variable cond;
+        std::optional<Result> result;
+    };
+    auto st = std::make_shared<State>();
+    Helpers::instance().spawn([st, f = std::move(f)]() mutable {
+        Result r = f();
+        std::unique_lock l(st->mut);
+        st->result.emplace(std::move(r));
+        st->cond.notify_all();
+    });
+
+    const size_t sub = interrupt.subscribe([st]{ std::unique_lock l(st->mut); st->cond.notify_all(); });
+    Defer d([&]{ interrupt.unsubscribe(sub); });
+    std::unique_lock l(st->mut);
+    st->cond.wait(l, [&]{ return st->result.has_value() || bool(interrupt); });
+    return std::move(st->result);
+}
+
+/// What miniupnpc told us about an IGD. Owns the strings in `urls`.
+struct IgdDesc {
+    int r = 0; ///< as returned by UPNP_GetValidIGD() or UPNP_GetIGDFromUrl(); 1 means we have a usable IGD
+    UPNPUrls urls = {};
+    IGDdatas data = {};
+    char lanaddr[64] = {};
+    std::vector<std::string> devices; ///< description URLs of the devices discovery found, if it was done
+
+    IgdDesc() = default;
+    IgdDesc(IgdDesc && o) noexcept : r(o.r), urls(std::exchange(o.urls, {})), data(o.data), devices(std::move(o.devices)) {
+        std::memcpy(lanaddr, o.lanaddr, sizeof(lanaddr));
+    }
+    IgdDesc &operator=(IgdDesc &&) = delete;
+    ~IgdDesc() { FreeUPNPUrls(&urls); }
+
+    /// Returns a deep copy (minus `devices`)
+    IgdDesc clone() const {
+        const auto dup = [](const char *str) { return str ? strdup(str) : nullptr; }; // FreeUPNPUrls() free()s them
+        IgdDesc ret;
+        ret.r = r;
+        ret.urls.controlURL = dup(urls.controlURL);
+        ret.urls.ipcondescURL = dup(urls.ipcondescURL);
+        ret.urls.controlURL_CIF = dup(urls.controlURL_CIF);
+        ret.urls.controlURL_6FC = dup(urls.controlURL_6FC);
+        ret.urls.rootdescURL = dup(urls.rootdescURL);
+        ret.data = data;
+        std::memcpy(ret.lanaddr, lanaddr, sizeof(lanaddr));
+        return ret;
+    }
+};
+
+// The following do blocking network I/O, and are meant to be called via runInterruptible()
+
+/// Returns the list of UPnP devices that answer an SSDP search; free it with freeUPNPDevlist()
+UPNPDev *discoverDevices(std::chrono::milliseconds timeout) {
+    int error [[maybe_unused]] {};
+    const int delay_msec = int(timeout.count());
+#ifndef UPNPDISCOVER_SUCCESS
+    /* miniupnpc 1.5 */
+    return upnpDiscover(delay_msec, nullptr, nullptr, 0);
+#elif MINIUPNPC_API_VERSION < 14
+    /* miniupnpc 1.6 */
+    return upnpDiscover(delay_msec, nullptr, nullptr, 0, 0, &error);
+#else
+    /* miniupnpc 1.9.20150730 */
+    return upnpDiscover(delay_msec, nullptr, nullptr, 0, 0, 2, &error);
+#endif
+}
+
+/// Discovers the devices on the network and picks the best IGD among them
+IgdDesc discoverIgd(std::chrono::milliseconds timeout) {
+    IgdDesc ret;
+    UPNPDev *devlist = discoverDevices(timeout);
+    for (UPNPDev *d = devlist; d; d = d->pNext) ret.devices.emplace_back(d->descURL);
+    ret.r = UPNP_GetValidIGD(devlist, &ret.urls, &ret.data, ret.lanaddr, sizeof(ret.lanaddr));
+    if (devlist) freeUPNPDevlist(devlist);
+    return ret;
+}
+
+/// Reads the description of the IGD whose root description is at `descURL`
+IgdDesc readIgd(const std::string &descURL) {
+    IgdDesc ret;
+    ret.r = UPNP_GetIGDFromUrl(descURL.c_str(), &ret.urls, &ret.data, ret.lanaddr, sizeof(ret.lanaddr));
+    return ret;
+}
+
+/// Discovers the devices on the network with upnpDiscover(), returning them along with the root description URLs of
+/// all the connected IGDs among them (one per control URL)
+std::pair<std::vector<std::string>, std::vector<std::string>> discoverAllIgds(std::chrono::milliseconds timeout) {
+    std::vector<std::string> devices, igds, controlURLs;
+    UPNPDev *devlist = discoverDevices(timeout);
+    for (UPNPDev *d = devlist; d; d = d->pNext) {
+        devices.emplace_back(d->descURL);
+        IgdDesc igd = readIgd(d->descURL);
+        if (igd.r != 1 || !igd.urls.controlURL || !UPNPIGD_IsConnected(&igd.urls, &igd.data)) continue;
+        if (std::find(controlURLs.begin(), controlURLs.end(), igd.urls.controlURL) != controlURLs.end()) continue;
+        controlURLs.emplace_back(igd.urls.controlURL);
+        igds.emplace_back(d->descURL);
+    }
+    if (devlist) freeUPNPDevlist(devlist);
+    return {std::move(devices), std::move(igds)};
+}
+
+/// The IGD descriptions read so far by this process, keyed by root description URL. A device doesn't change its
+/// description while it stays up (and gets a new URL when it restarts, more often than not), so redoing discovery
+/// need only read the descriptions of devices it hasn't seen before. Thread-safe.
+class DescCache
+{
+    std::mutex mut;
+    std::map<std::string, IgdDesc> descs;
+public:
+    static DescCache &instance() {
+        static DescCache *const cache = new DescCache; // never destroyed, see Helpers
+        return *cache;
+    }
+
+    std::optional<IgdDesc> get(const std::string &url) {
+        std::unique_lock l(mut);
+        const auto it = descs.find(url);
+        if (it == descs.end()) return std::nullopt;
+        return it->second.clone();
+    }
+    void put(const std::string &url, const IgdDesc &desc) {
+        std::unique_lock l(mut);
+        descs.erase(url);
+        descs.emplace(url, desc.clone());
+    }
+    void erase(const std::string &url) {
+        std::unique_lock l(mut);
+        descs.erase(url);
+    }
+};
+
+/// Listens for SSDP announcements on a thread of its own, to learn right away when the IGD we follow restarts (wiping
+/// its port mappings), rather than at the next refresh, and sets each of the `wakes` it was given when it does. It also
+/// counts the IGDs that turn up while we follow none, without waking anyone: the IGD backoff decides when to look for
+/// them. Thread-safe.
+class IgdWatch
+{
+public:
+    IgdWatch(const std::string &threadName, std::vector<ThreadInterrupt *> wakes_) : wakes(std::move(wakes_)) {
+        thread = std::thread([this, threadName] {
+            TraceThread(threadName, [this] {
+                if (!Ssdp::listen([this](const Ssdp::Notify &n) { onNotify(n); }, stop))
+                    Debug() << "SSDP: not listening for announcements, so IGD restarts only get noticed on refresh";
+            });
+        });
+    }
+    ~IgdWatch() { stop(); thread.join(); }
+
+    /// Follow the IGD whose root description is at `descURL`, or none if empty
+    void follow(const std::string &descURL) {
+        std::unique_lock l(mut);
+        if (descURL == location) return;
+        location = descURL;
+        arrived = false;
+        uuids.clear();
+        gone = false;
+        bootId.reset();
+        configId.reset();
+    }
+
+    /// Number of times the IGD we follow has restarted (or changed its configuration)
+    uint64_t restarts() const { return nRestarts; }
+    /// Number of times an IGD announced itself while we followed none
+    uint64_t arrivals() const { return nArrivals; }
+
+private:
+    std::vector<ThreadInterrupt *> wakes;
+    ThreadInterrupt stop;
+    std::thread thread;
+    std::atomic<uint64_t> nRestarts{0}, nArrivals{0};
+
+    std::mutex mut;
+    std::string location; ///< of the IGD we follow
+    std::vector<std::string> uuids; ///< of its devices, from its announcements for the IgdTargets
+    bool gone = false; ///< it said ssdp:byebye
+    bool arrived = false; ///< an IGD announced itself while we followed none
+    std::optional<uint32_t> bootId, configId; ///< as last announced
+
+    void wakeAll() { for (auto *w : wakes) (*w)(); }
+
+    void onNotify(const Ssdp::Notify &n) {
+        // Routers often host other root devices too (media servers, TR-064...), and the IGD itself announces devices
+        // and services we don't use, so only the announcements for the IgdTargets tell us anything
+        if (std::find(std::begin(Ssdp::IgdTargets), std::end(Ssdp::IgdTargets), n.nt) == std::end(Ssdp::IgdTargets))
+            return;
+        std::unique_lock l(mut);
+        if (location.empty()) {
+            if (n.kind != Ssdp::Notify::Alive) return;
+            if (!std::exchange(arrived, true)) Log("UPnP: %s announced itself", n.location);
+            ++nArrivals;
+            return;
+        }
+        // A byebye has no LOCATION, and the IGD may come back from a restart at another one, so we know it by the
+        // UUIDs of its devices instead, learnt from what it announces at the location we follow
+        const std::string uuid = n.usn.substr(0, n.usn.find("::"));
+        const bool known = !uuid.empty() && std::find(uuids.begin(), uuids.end(), uuid) != uuids.end();
+        if (n.kind == Ssdp::Notify::ByeBye) {
+            if (!gone && known) {
+                Log("UPnP: IGD %s is going away", location);
+                gone = true;
+            }
+            return;
+        }
+        if (!known) {
+            if (uuid.empty() || n.location != location) return;
+            uuids.push_back(uuid);
+        }
+        if (n.kind == Ssdp::Notify::Update) {
+            if (n.nextBootId) bootId = n.nextBootId;
+            return;
+        }
+        std::string why;
+        if (gone) why = "came back";
+        else if (n.location != location) why = strprintf("moved to %s", n.location);
+        else if (n.bootId && bootId && *n.bootId != *bootId) why = "restarted";
+        else if (n.configId && configId && *n.configId != *configId) why = "changed its configuration";
+        if (n.bootId) bootId = n.bootId;
+        if (n.configId) configId = n.configId;
+        if (why.empty()) return;
+        Log("UPnP: IGD %s %s, remapping everything", location, why);
+        // Until it has been set up again, take its further announcements as part of the same restart
+        location = n.location;
+        gone = false;
+        ++nRestarts;
+        l.unlock();
+        wakeAll();
+    }
+};
+
+/// Runs Net::watchAddresses() on a thread of its own, counting the changes to our addresses and routes it reports and
+/// setting each of the `wakes` it was given on each one
+class AddressWatch
+{
+public:
+    AddressWatch(const std::string &threadName, std::vector<ThreadInterrupt *> wakes_) : wakes(std::move(wakes_)) {
+        thread = std::thread([this, threadName] {
+            TraceThread(threadName, [this] {
+                const bool ok = Net::watchAddresses([this] {
+                    Debug() << "Our addresses or routes changed";
+                    ++nChanges;
+                    for (auto *w : wakes) (*w)();
+                }, stop);
+                if (!ok) Debug() << "Not watching for address changes, so they only get noticed when mappings fail";
+            });
+        });
+    }
+    ~AddressWatch() { stop(); thread.join(); }
+
+    uint64_t changes() const { return nChanges; }
+
+private:
+    std::vector<ThreadInterrupt *> wakes;
+    ThreadInterrupt stop;
+    std::thread thread;
+    std::atomic<uint64_t> nChanges{0};
+};
+
+/// A timeout learned from the latencies we observe, so that waiting on a fast network doesn't take as long as on the
+/// slowest one we allow for. It is a small multiple of the p99 of the last few latencies (with this few samples, the
+/// slowest of them), kept within [`min`, the caller's maximum], and is just the maximum until there are enough samples.
+/// Each miss (nothing answered in time) doubles it, for as long as the samples say otherwise; each hit halves the
+/// extra again. Thread-safe.
+class AdaptiveTimeout
+{
+    static constexpr size_t NSamples = 32, MinSamples = 3;
+    static constexpr int Multiple = 3;
+
+    mutable std::mutex mut;
+    const char *what;
+    const Clock::duration min;
+    std::array<Clock::duration, NSamples> samples{}; ///< a ring buffer, the latest at `count % NSamples`
+    size_t count = 0; ///< samples recorded in all
+    Clock::duration floor{}; ///< raised by misses, lowered by hits
+
+    std::optional<Clock::duration> p99() const {
+        const size_t n = std::min(count, NSamples);
+        if (n < MinSamples) return std::nullopt;
+        std::array<Clock::duration, NSamples> sorted = samples;
+        std::sort(sorted.begin(), sorted.begin() + n);
+        return sorted[(n * 99 + 99) / 100 - 1];
+    }
+    Clock::duration getLocked(Clock::duration max) const {
+        const auto p = p99();
+        if (!p) return max;
+        return std::clamp(std::max(*p * Multiple, floor), std::min(min, max), max);
+    }
+
+public:
+    AdaptiveTimeout(const char *what, Clock::duration min) : what(what), min(min) {}
+
+    /// The time it takes the first plausible IGD to answer an SSDP search
+    static AdaptiveTimeout &ssdp() {
+        // Never destroyed, like the other statics the Helpers use
+        static AdaptiveTimeout *const t = new AdaptiveTimeout("SSDP window", std::chrono::milliseconds{100});
+        return *t;
+    }
+    /// The time it takes to read an IGD's description and check that it is connected
+    static AdaptiveTimeout &desc() {
+        // Never destroyed, as above
+        static AdaptiveTimeout *const t = new AdaptiveTimeout("description timeout", std::chrono::milliseconds{500});
+        return *t;
+    }
+
+    Clock::duration get(Clock::duration max) const { std::unique_lock l(mut); return getLocked(max); }
+
+    void record(Clock::duration latency) {
+        std::unique_lock l(mut);
+        samples[count++ % NSamples] = latency;
+    }
+    /// Something answered within the timeout
+    void hit() { std::unique_lock l(mut); floor /= 2; }
+    /// Nothing answered within `used`: double the timeout, up to `max`
+    void miss(Clock::duration used, Clock::duration max) {
+        std::unique_lock l(mut);
+        floor = std::min(used * 2, max);
+    }
+
+    std::string toString(Clock::duration max) const {
+        std::unique_lock l(mut);
+        const auto ms = [](Clock::duration d) { return long(std::chrono::ceil<std::chrono::milliseconds>(d).count()); };
+        const auto p = p99();
+        return strprintf("%s %d ms (p99 %s over %d samples, floor %d ms)", what, ms(getLocked(max)),
+                         p ? strprintf("%d ms", ms(*p)) : std::string("unknown"), std::min(count, NSamples), ms(floor));
+    }
+};
+
+/// Reads the description at `url` (unless cached) and checks that the IGD is connected. The resulting `r` is as
+/// UPNP_GetValidIGD() would return: 1 for a connected IGD, 2 for one that isn't connected, 0 on failure.
+IgdDesc probeIgd(const std::string &url) {
+    std::optional<IgdDesc> igd = DescCache::instance().get(url);
+    if (igd) {
+        // Our own address may have changed since: find it again, as UPNP_GetIGDFromUrl() would
+        const auto ctl = igd->urls.controlURL ? Net::parseHttpUrl(igd->urls.controlURL) : std::nullopt;
+        const auto local = ctl ? Net::localAddressFor(ctl->host, ctl->port) : std::nullopt;
+        if (local && local->size() < sizeof(igd->lanaddr)) std::strcpy(igd->lanaddr, local->c_str());
+        else igd.reset();
+    }
+    if (!igd) {
+        igd.emplace(readIgd(url));
+        if (igd->r == 1) DescCache::instance().put(url, *igd);
+    }
+    if (igd->r == 1 && !UPNPIGD_IsConnected(&igd->urls, &igd->data)) igd->r = 2;
+    return std::move(*igd);
+}
+
+/// Probes the devices that answer discovery concurrently, with probeIgd() on a helper thread each (see Helpers), so
+/// that slow devices don't hold up the rest. Each probe gets the learned AdaptiveTimeout::desc() (at most
+/// MaxDescTimeout), after which it is abandoned, as are those still running when the IgdProber goes away.
+class IgdProber
+{
+public:
+    static constexpr std::chrono::seconds MaxDescTimeout{5};
+    struct Result {
+        std::string url;
+        IgdDesc igd;
+    };
+
+    /// `onUsable` is called, from the probe's helper thread, whenever a probe finds a connected IGD
+    explicit IgdProber(std::function<void()> onUsable) : shared(std::make_shared<Shared>()) {
+        shared->onUsable = std::move(onUsable);
+    }
+    ~IgdProber() { std::unique_lock l(shared->mut); shared->onUsable = {}; }
+
+    void start(const std::string &url) {
+        const auto t0 = Clock::now();
+        urls.push_back(url);
+        starts.push_back(t0);
+        std::unique_lock l(shared->mut);
+        const size_t idx = shared->pending.size();
+        shared->pending.push_back(t0 + AdaptiveTimeout::desc().get(MaxDescTimeout));
+        Helpers::instance().spawn([sh = shared, url, idx, t0] {
+            IgdDesc igd = probeIgd(url);
+            if (igd.r >= 1) AdaptiveTimeout::desc().record(Clock::now() - t0);
+            std::unique_lock l(sh->mut);
+            if (sh->pending[idx] == Clock::time_point{}) return; // timed out
+            sh->pending[idx] = {};
+            const bool usable = igd.r == 1;
+            sh->results.push_back({url, std::move(igd)});
+            sh->cond.notify_all();
+            if (usable && sh->onUsable) sh->onUsable();
+        });
+    }
+
+    /// Waits until every probe has finished or timed out (or, if `firstOnly`, until one finds a connected IGD), or
+    /// `interrupt` is set. Returns the results in the order they came in.
+    std::vector<Result> finish(const ThreadInterrupt &interrupt, bool firstOnly) {
+        const size_t sub = interrupt.subscribe([sh = shared] { std::unique_lock l(sh->mut); sh->cond.notify_all(); });
+        Defer d([&] { interrupt.unsubscribe(sub); });
+        std::unique_lock l(shared->mut);
+        const auto &results = shared->results;
+        for (;;) {
+            if (interrupt) break;
+            if (firstOnly && std::any_of(results.begin(), results.end(), [](const Result &r) { return r.igd.r == 1; }))
+                break;
+            // Wait for the probe due to time out soonest, timing it out if it's late
+            const auto it = std::min_element(shared->pending.begin(), shared->pending.end(), [](auto a, auto b) {
+                return a != Clock::time_point{} && (b == Clock::time_point{} || a < b);
+            });
+            if (it == shared->pending.end() || *it == Clock::time_point{}) break; // all done
+            const size_t n = results.size();
+            if (!shared->cond.wait_until(l, *it, [&] { return results.size() != n || bool(interrupt); })) {
+                const size_t idx = size_t(it - shared->pending.begin());
+                Debug("Timed out reading the description at %s", urls[idx]);
+                AdaptiveTimeout::desc().miss(*it - starts[idx], MaxDescTimeout);
+                *it = {};
+            }
+        }
+        return std::move(shared->results);
+    }
+
+private:
+    struct Shared {
+        std::mutex mut;
+        std::condition_variable cond;
+        std::vector<Clock::time_point> pending; ///< deadline of each probe, by start order; reset once it's done
+        std::vector<Result> results;
+        std::function<void()> onUsable;
+    };
+    std::shared_ptr<Shared> shared;
+    std::vector<std::string> urls; ///< of each probe, by start order
+    std::vector<Clock::time_point> starts; ///< of each probe, by start order
+};
+
+/// What probeDevices() found
+struct Probed {
+    bool searched = false; ///< false if no SSDP search could be sent at all
+    std::vector<std::string> devices; ///< the root description URLs of the plausible IGDs that answered
+    std::vector<IgdProber::Result> results;
+};
+
+/// Searches for IGDs with SSDP, probing each plausible device as soon as it answers. Devices whose response shows
+/// they aren't what we asked for (many answer any search) are dropped before any HTTP request is made. If `firstOnly`,
+/// we stop as soon as a connected IGD turns up; otherwise we search for the whole `timeout`, to find them all. Returns
+/// std::nullopt if interrupted.
+std::optional<Probed> probeDevices(std::chrono::milliseconds timeout, const ThreadInterrupt &interrupt, bool firstOnly) {
+    if (interrupt) return std::nullopt;
+    Probed ret;
+    ThreadInterrupt stop; // stops the search: set on interrupt, or (if firstOnly) once we have a connected IGD
+    const size_t sub = interrupt.subscribe([&stop] { stop(); });
+    Defer d([&] { interrupt.unsubscribe(sub); });
+    IgdProber prober(firstOnly ? std::function<void()>([&stop] { stop(); }) : std::function<void()>());
+    ret.searched = Ssdp::search({std::begin(Ssdp::IgdTargets), std::end(Ssdp::IgdTargets)}, timeout,
+                                [&](const Ssdp::Response &resp) {
+        if (!Ssdp::isIgd(resp)) {
+            Debug("SSDP: ignoring %s, which answered for %s", resp.location, resp.st);
+            return false;
+        }
+        Debug("SSDP: %s answered for %s", resp.location, resp.st);
+        AdaptiveTimeout::ssdp().record(resp.latency);
+        ret.devices.push_back(resp.location);
+        prober.start(resp.location);
+        return false;
+    }, &stop);
+    ret.results = prober.finish(interrupt, firstOnly);
+    if (interrupt) return std::nullopt;
+    return ret;
+}
+
+/// Like discoverIgd(), but with our own SSDP search, returning the first connected IGD to answer rather than waiting
+/// out the whole `timeout`. The first search only waits the window learned from past answers (AdaptiveTimeout::ssdp());
+/// if no IGD answers within it, the window is widened for next time and we search again for the rest of `timeout`.
+/// Falls back to discoverIgd() if no search can be sent. Returns std::nullopt if interrupted.
+std::optional<IgdDesc> searchIgd(std::chrono::milliseconds timeout, const ThreadInterrupt &interrupt) {
+    auto &window = AdaptiveTimeout::ssdp();
+    std::optional<Probed> probed;
+    for (auto wait = std::chrono::ceil<std::chrono::milliseconds>(window.get(timeout)), left = timeout; ; ) {
+        probed = probeDevices(wait, interrupt, true);
+        if (!probed) return std::nullopt;
+        if (!probed->searched) {
+            Debug() << "SSDP: could not send a search, falling back to upnpDiscover()";
+            return runInterruptible(interrupt, [timeout] { return discoverIgd(timeout); });
+        }
+        if (!probed->devices.empty()) {
+            window.hit();
+            break;
+        }
+        if (wait == left) break; // missed, and already widened
+        window.miss(wait, timeout);
+        left -= wait;
+        wait = left;
+        Debug("SSDP: no IGD answered within the learned window, searching again for %d ms", wait.count());
+    }
+    Debug("Discovery: %s; %s", window.toString(timeout), AdaptiveTimeout::desc().toString(IgdProber::MaxDescTimeout));
+    // The connected IGD if we found one, else an unconnected one (for the error message), else nothing
+    IgdDesc *best = nullptr;
+    for (auto &res : probed->results)
+        if (res.igd.r >= 1 && (!best || res.igd.r < best->r)) best = &res.igd;
+    std::optional<IgdDesc> ret;
+    if (best) ret.emplace(std::move(*best));
+    else ret.emplace();
+    ret->devices = std::move(probed->devices);
+    return ret;
+}
+
+/// Like discoverAllIgds(), but with our own SSDP search. Returns std::nullopt if interrupted.
+std::optional<std::pair<std::vector<std::string>, std::vector<std::string>>>
+findAllIgds(std::chrono::milliseconds timeout, const ThreadInterrupt &interrupt) {
+    auto probed = probeDevices(timeout, interrupt, false);
+    if (!probed) return std::nullopt;
+    if (!probed->searched) {
+        Debug() << "SSDP: could not send a search, falling back to upnpDiscover()";
+        return runInterruptible(interrupt, [timeout] { return discoverAllIgds(timeout); });
+    }
+    // Keep the IGDs in the order they answered in, so that they get numbered the same from one run to the next
+    std::vector<std::string> igds, controlURLs;
+    for (const auto &url : probed->devices) {
+        const auto it = std::find_if(probed->results.begin(), probed->results.end(),
+                                     [&](const IgdProber::Result &r) { return r.url == url; });
+        if (it == probed->results.end() || it->igd.r != 1 || !it->igd.urls.controlURL) continue;
+        if (std::find(controlURLs.begin(), controlURLs.end(), it->igd.urls.controlURL) != controlURLs.end()) continue;
+        controlURLs.emplace_back(it->igd.urls.controlURL);
+        igds.push_back(url);
+    }
+    return std::pair{std::move(probed->devices), std::move(igds)};
+}
+
+/// What we remember about the IGD we last used, so that a restart can skip discovery if it is still there
+struct IgdCache {
+    std::string descURL, controlURL, serviceType, lanaddr;
+
+    /// Returns std::nullopt if the file doesn't exist or is missing any of the fields
+    static std::optional<IgdCache> load(const std::string &path) {
+        std::ifstream f(path);
+        if (!f) return std::nullopt;
+        IgdCache ret;
+        std::string line;
+        while (std::getline(f, line)) {
+            const auto eq = line.find('=');
+            if (eq == line.npos) continue;
+            const std::string key = line.substr(0, eq), val = line.substr(eq + 1);
+            if (key == "descURL") ret.descURL = val;
+            else if (key == "controlURL") ret.controlURL = val;
+            else if (key == "serviceType") ret.serviceType = val;
+            else if (key == "lanaddr") ret.lanaddr = val;
+        }
+        if (ret.descURL.empty() || ret.controlURL.empty() || ret.serviceType.empty() || ret.lanaddr.empty())
+            return std::nullopt;
+        return ret;
+    }
+
+    /// Writes the file atomically (via a temporary file and a rename), so that a crash can't leave half of it behind
+    bool save(const std::string &path) const {
+        const std::string tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::trunc);
+            f << "descURL=" << descURL << "\ncontrolURL=" << controlURL << "\nserviceType=" << serviceType
+              << "\nlanaddr=" << lanaddr << "\n";
+            if (!f.flush()) return false;
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+        return !ec;
+    }
+};
+
+/// Manages the upnp context for one IGD, does RAII auto-cleanup, etc.
+struct UpnpCtx {
+    /// Root description URL of the IGD to use. If empty, setup() discovers the IGDs on the network and picks one.
+    std::string descURL;
+    /// If set (and `descURL` is empty), the first setup() tries the IGD remembered in this file before resorting to
+    /// discovery, and every discovery that finds a working IGD updates the file.
+    std::string cachePath;
+    /// Upper bound on how long discovery may wait for IGDs to answer
+    std::chrono::milliseconds discoverTimeout = UpnpMgr::DefaultDiscoverTimeout;
+    UPNPUrls urls = {};
+    IGDdatas data = {};
+    std::string externalIPAddress;
+    char lanaddr[64] = {};
+    SoapClient soap; ///< used for all SOAP calls to the IGD's control URL once discovery is done
+
+    void cleanup() noexcept {
+        soap.reset();
+        FreeUPNPUrls(&urls);
+        externalIPAddress.clear();
+        std::memset(lanaddr, 0, sizeof(lanaddr));
+    }
+    bool setup(unsigned maxConns, const ThreadInterrupt &interrupt) {
+        cleanup();
+        if (std::exchange(tryCache, false) && descURL.empty() && !cachePath.empty()) {
+            if (setupFromCache(maxConns, interrupt)) return true;
+            cleanup();
+            if (interrupt) return false;
+        }
+        auto igd = descURL.empty() ? searchIgd(discoverTimeout, interrupt)
+                                   : runInterruptible(interrupt, [url = descURL] { return readIgd(url); });
+        if (!igd) {
+            Debug() << "UPnP discovery interrupted";
+            return false;
+        }
+        int i{};
+        for (const auto &d : igd->devices)
+            Debug("Found UPNP Dev %d: %s", i++, d);
+        if (igd->r != 1) {
+            if (descURL.empty()) Error("No valid UPnP IGDs found (r=%d)", igd->r);
+            else Error("Could not get the IGD description at %s (r=%d)", descURL, igd->r);
+            return false;
+        }
+        urls = std::exchange(igd->urls, {});
+        data = igd->data;
+        std::memcpy(lanaddr, igd->lanaddr, sizeof(lanaddr));
+        Log("UPnP: Local IP = %s", lanaddr);
+
+        if (!soap.setup(urls.controlURL, data.first.servicetype, maxConns)) {
+            Error("Unsupported IGD control URL: %s", urls.controlURL);
+            return false;
+        }
+
+        /* Probe external IP */
+        const int r = soap.getExternalIPAddress(externalIPAddress, &interrupt);
+        if (r != UPNPCOMMAND_SUCCESS) {
+            Log("UPnP: GetExternalIPAddress() returned %d", r);
+        } else {
+            if (!externalIPAddress.empty()) {
+                Log("UPnP: External IP = %s", externalIPAddress);
+            } else {
+                Log("UPnP: GetExternalIPAddress failed.");
+            }
+            saveCache();
+        }
+        return true;
+    }
+    /// Remembers the IGD we use (and our address) in `cachePath`, if we discovered it and have somewhere to put it
+    void saveCache() const {
+        if (!descURL.empty() || cachePath.empty() || !urls.rootdescURL) return;
+        const IgdCache cache{urls.rootdescURL, urls.controlURL, data.first.servicetype, lanaddr};
+        if (!cache.save(cachePath)) Warning("UPnP: Could not write the IGD cache file %s", cachePath);
+    }
+    ~UpnpCtx() noexcept { cleanup(); }
+
+private:
+    bool tryCache = true;
+
+    /// Sets up using the IGD remembered in `cachePath`, provided we still reach it from the same LAN address and it
+    /// answers a GetExternalIPAddress (which we would send anyway). This saves the seconds that discovery takes.
+    bool setupFromCache(unsigned maxConns, const ThreadInterrupt &interrupt) {
+        const auto cache = IgdCache::load(cachePath);
+        if (!cache) return false;
+        const auto url = Net::parseHttpUrl(cache->controlURL);
+        if (!url || cache->serviceType.size() >= sizeof(data.first.servicetype)
+                || cache->lanaddr.size() >= sizeof(lanaddr)) {
+            Debug("Ignoring malformed IGD cache file %s", cachePath);
+            return false;
+        }
+        if (const auto local = Net::localAddressFor(url->host, url->port); local != cache->lanaddr) {
+            Debug("Cached IGD at %s is no longer reached from %s, rediscovering", cache->controlURL, cache->lanaddr);
+            return false;
+        }
+        if (!soap.setup(cache->controlURL, cache->serviceType, maxConns)) return false;
+        if (const int r = soap.getExternalIPAddress(externalIPAddress, &interrupt); r != UPNPCOMMAND_SUCCESS) {
+            Debug("Cached IGD at %s did not respond (code %d), rediscovering", cache->controlURL, r);
+            return false;
+        }
+        urls.controlURL = strdup(cache->controlURL.c_str()); // freed by FreeUPNPUrls()
+        urls.rootdescURL = strdup(cache->descURL.c_str());
+        std::strcpy(data.first.servicetype, cache->serviceType.c_str());
+        std::strcpy(lanaddr, cache->lanaddr.c_str());
+        Log("UPnP: Using cached IGD %s", cache->descURL);
+        Log("UPnP: Local IP = %s", lanaddr);
+        if (!externalIPAddress.empty()) Log("UPnP: External IP = %s", externalIPAddress);
+        return true;
+    }
+};
+} // namespace
 
 UpnpMgr::UpnpMgr(std::string_view name_) : name(name_) {}
 
 UpnpMgr::~UpnpMgr() { stop(); }
 
-void UpnpMgr::start(PortVec pv, std::function<void()> errorCallback_)
+void UpnpMgr::start(PortSets ps, const Options &options_, std::function<void()> errorCallback_)
 {
     stop();
     errorCallback = std::move(errorCallback_);
-
-    // ensure pv is sorted and contains unique elements before assigning to `ports`
-    std::sort(pv.begin(), pv.end());
-    auto it = std::unique(pv.begin(), pv.end());
-    if (it != pv.end()) {
-        pv.erase(it, pv.end());
-        pv.shrink_to_fit();
-    }
-    ports = std::move(pv);
+    options = options_;
+    options.maxJobs = std::max(options.maxJobs, 1u);
+    ports = std::move(ps);
 
     thread = std::thread([this]{
         TraceThread(name, [this]{
@@ -39,8 +919,13 @@ void UpnpMgr::start(PortVec pv, std::function<void()> errorCallback_)
 void UpnpMgr::stop()
 {
     if (thread.joinable()) {
+        const auto t0 = Clock::now();
         interrupt();
         thread.join();
+        // Give the blocking calls we stopped waiting for a moment to finish, but no more: they may take ages
+        if (const size_t n = Helpers::instance().joinFor(HelperGrace))
+            Debug("%s: left %u blocking call(s) to finish on their own", name, n);
+        Debug("%s: stopped in %1.3f sec", name, std::chrono::duration<double>(Clock::now() - t0).count());
     }
     interrupt.reset();
     if (errorCallback) errorCallback = {}; // clear
@@ -57,122 +942,882 @@ void UpnpMgr::run()
         }
     });
 
-    if (ports.empty()) {
-        Error() << "Pass a vector of ports!";
+    if (!options.fleet.empty()) {
+        errorFlag = !runFleet();
+        return;
+    }
+
+    std::string desc;
+    size_t count = 0;
+    for (const Proto p : AllProtos) {
+        const PortSet &ps = ports[size_t(p)];
+        count += ps.size();
+        if (!ps.empty()) desc += strprintf("%s%s: %s", desc.empty() ? "" : ", ", protoName(p), ps.toString());
+        if (const PortMap &pm = options.extPorts[size_t(p)]; !pm.empty())
+            desc += strprintf(" (external:internal %s)", pm.toString());
+    }
+    if (!count) {
+        Error() << "Pass a set of ports!";
         return;
     }
-    Log() << "UPNP thread started, will manage " << ports.size() << " port mapping(s), probing for IGDs ...";
+    Log() << "UPNP thread started, will manage " << count << " port mapping(s) (" << desc
+          << ") using up to " << options.maxJobs << " concurrent request(s) and a lease of "
+          << (options.lease.count() ? strprintf("%d sec", options.lease.count()) : std::string("forever"))
+          << ", probing for IGDs ...";
 
-    // Manages the upnp context, does RAII auto-cleanup, etc.
-    struct UpnpCtx {
-        struct UPNPDev *devlist = nullptr;
-        UPNPUrls urls = {};
-        IGDdatas data = {};
-        char externalIPAddress[80] = {0};
-        char lanaddr[64] = {};
+    if (!options.allIgds) {
+        errorFlag = !runIgd(options.igdUrl);
+        return;
+    }
 
-        void cleanup() noexcept {
-            FreeUPNPUrls(&urls);
-            if (devlist) { freeUPNPDevlist(devlist); devlist = nullptr; }
-            std::memset(externalIPAddress, 0, sizeof(externalIPAddress));
-            std::memset(lanaddr, 0, sizeof(lanaddr));
-        }
-        bool setup() {
-            cleanup();
-            int r{}, i{}, error [[maybe_unused]] {};
-            /* Discover */
-            constexpr int delay_msec = 2000;
-#ifndef UPNPDISCOVER_SUCCESS
-            /* miniupnpc 1.5 */
-            devlist = upnpDiscover(delay_msec, nullptr, nullptr, 0);
-#elif MINIUPNPC_API_VERSION < 14
-            /* miniupnpc 1.6 */
-            devlist = upnpDiscover(delay_msec, nullptr, nullptr, 0, 0, &error);
-#else
-            /* miniupnpc 1.9.20150730 */
-            devlist = upnpDiscover(delay_msec, nullptr, nullptr, 0, 0, 2, &error);
-#endif
-            for (UPNPDev *d = devlist; d; d = d->pNext)
-                Debug("Found UPNP Dev %d: %s", i++, d->descURL);
+    // Find all the connected IGDs, then manage the mappings on each of them from its own thread, with its own
+    // context and state, so that a slow or failing router holds up nobody else
+    const auto found = findAllIgds(options.discoverTimeout, interrupt);
+    if (!found) {
+        Debug() << "UPnP discovery interrupted";
+        errorFlag = false;
+        return;
+    }
+    const auto &[devices, igds] = *found;
+    for (size_t i = 0; i < devices.size(); ++i)
+        Debug("Found UPNP Dev %d: %s", i, devices[i]);
+    if (igds.empty()) {
+        Error() << "No connected UPnP IGDs found";
+        return;
+    }
+    Log("UPnP: found %d connected IGD(s), managing mappings on all of them", igds.size());
+    std::atomic_bool anyOk = false;
+    std::vector<std::thread> threads;
+    threads.reserve(igds.size());
+    for (size_t i = 0; i < igds.size(); ++i) {
+        threads.emplace_back([this, &anyOk, i, &url = igds[i]]{
+            TraceThread(strprintf("%s/%d", name, i + 1), [this, &anyOk, &url]{
+                if (runIgd(url)) anyOk = true;
+            });
+        });
+    }
+    for (auto &t : threads) t.join();
+    errorFlag = !anyOk && !interrupt;
+}
 
-            /* Get valid IGD */
-            r = UPNP_GetValidIGD(devlist, &urls, &data, lanaddr, sizeof(lanaddr));
-            if (r != 1) {
-                Error("No valid UPnP IGDs found (r=%d)", r);
-                return false;
-            }
-            Log("UPnP: Local IP = %s", lanaddr);
+bool UpnpMgr::runIgd(const std::string &descURL)
+{
+    // The mappings we want, and the mappings we have, as bitmaps indexed by protocol then internal port
+    ProtoBitmaps desired, mapped;
+    for (const Proto p : AllProtos)
+        desired[size_t(p)].assign(ports[size_t(p)]);
+    // The external port of each mapping, where the router assigned one other than the one we asked for (--any-port)
+    std::array<std::unordered_map<uint16_t, uint16_t>, NumProtos> extPorts;
+    const auto extPortOf = [this, &extPorts](Proto proto, uint16_t prt) {
+        const auto &m = extPorts[size_t(proto)];
+        const auto it = m.find(prt);
+        return it != m.end() ? it->second : options.extPorts[size_t(proto)].external(prt);
+    };
+
+    UpnpCtx ctx;
+    ctx.descURL = descURL;
+    ctx.cachePath = options.igdCache;
+    ctx.discoverTimeout = options.discoverTimeout;
 
-            /* Probe external IP */
-            r = UPNP_GetExternalIPAddress(urls.controlURL, data.first.servicetype, externalIPAddress);
-            if (r != UPNPCOMMAND_SUCCESS) {
-                Log("UPnP: GetExternalIPAddress() returned %d", r);
+    if (!ctx.setup(options.maxJobs, interrupt))
+        return bool(interrupt); // not an error if we were told to stop while still setting up
+    if (!descURL.empty()) Log("UPnP: managing IGD %s (control URL %s)", descURL, ctx.urls.controlURL);
+
+    // Deletes the mappings in `which`, with as many requests in flight as we're allowed, and (if `ranges`) with
+    // contiguous runs of external ports deleted by a single DeletePortMappingRange on IGDv2. Gives up at `deadline`,
+    // or when `intr` (if specified) is set. Returns the external ports whose deletion we didn't see finish.
+    const auto unmap = [&ctx, &extPortOf](const ProtoBitmaps &which, bool ranges, Clock::time_point deadline,
+                                          const ThreadInterrupt *intr) {
+        struct Job { Proto proto; uint16_t first, last; };
+        std::deque<Job> jobs;
+        bool useRanges = ranges && std::string_view(ctx.data.first.servicetype).ends_with(":2");
+        for (const Proto p : AllProtos) {
+            PortBitmap exts;
+            which[size_t(p)].forEach([&](uint16_t prt) { exts.set(extPortOf(p, prt)); });
+            // These come out in ascending order, so contiguous runs can be merged as we go
+            exts.forEach([&](uint16_t ext) {
+                if (useRanges && !jobs.empty() && jobs.back().proto == p && jobs.back().last + 1u == ext)
+                    jobs.back().last = ext;
+                else
+                    jobs.push_back({p, ext, ext});
+            });
+        }
+        PortSets unfinished; // deletes that were never sent, or whose outcome we didn't get to see
+        const auto resultStr = [](int res) {
+            return res == UPNPCOMMAND_SUCCESS ? std::string("success") : strprintf("returned %d (%s)", res, errorName(res));
+        };
+        ctx.soap.run([&](SoapClient::Request &req) {
+            if (jobs.empty()) return false;
+            Job job = jobs.front();
+            jobs.pop_front();
+            if (job.first != job.last && !useRanges) {
+                // The router turned out not to support ranges: delete this run one port at a time
+                for (uint32_t prt = uint32_t(job.first) + 1u; prt <= job.last; ++prt)
+                    jobs.push_back({job.proto, uint16_t(prt), uint16_t(prt)});
+                job.last = job.first;
+            }
+            if (job.first == job.last) {
+                const std::string port = strprintf("%u", job.first);
+                Debug() << "Unmapping " << port << "/" << protoName(job.proto) << " ...";
+                req = {"DeletePortMapping", SoapClient::deletePortMappingArgs(port, protoName(job.proto)),
+                       [&, job, port](int res, auto &&) {
+                    if (res == SoapClient::Aborted) unfinished[size_t(job.proto)].insert(job.first);
+                    else Log("DeletePortMapping() for %s/%s: %s", port, protoName(job.proto), resultStr(res));
+                }};
             } else {
-                if (externalIPAddress[0]) {
-                    Log("UPnP: External IP = %s", externalIPAddress);
+                const std::string range = strprintf("%u-%u", job.first, job.last);
+                Debug() << "Unmapping " << range << "/" << protoName(job.proto) << " ...";
+                req = {"DeletePortMappingRange",
+                       SoapClient::deletePortMappingRangeArgs(job.first, job.last, protoName(job.proto)),
+                       [&, job, range](int res, auto &&) {
+                    if (res == SoapClient::Aborted) {
+                        unfinished[size_t(job.proto)].insert(job.first, job.last);
+                    } else if (res == 401 /* InvalidAction */ || res == 602 /* OptionalActionNotImplemented */) {
+                        useRanges = false;
+                        jobs.push_back(job); // will be split up
+                    } else {
+                        Log("DeletePortMappingRange() for %s/%s: %s", range, protoName(job.proto), resultStr(res));
+                    }
+                }};
+            }
+            return true;
+        }, intr, deadline);
+        for (const Job &job : jobs)
+            unfinished[size_t(job.proto)].insert(job.first, job.last);
+        return unfinished;
+    };
+
+    Defer cleanup([this, &mapped, &ctx, &unmap]{
+        if (!ctx.urls.controlURL) return;
+        // Unmap everything we have. We give up once the shutdown timeout has passed, so as to exit before a service
+        // manager loses patience and kills us. Note: no interrupt passed here because we always want to unmap
+        // everything on exit.
+        const auto t0 = Clock::now();
+        const PortSets unfinished = unmap(mapped, true, t0 + options.shutdownTimeout, nullptr);
+        Debug("Unmapping took %1.3f sec", std::chrono::duration<double>(Clock::now() - t0).count());
+
+        std::string desc;
+        for (const Proto p : AllProtos)
+            if (const PortSet &ps = unfinished[size_t(p)]; !ps.empty())
+                desc += strprintf("%s%s: %s", desc.empty() ? "" : ", ", protoName(p), ps.toString());
+        if (!desc.empty())
+            Error("Unmapping did not finish within %d sec; these external port(s) may still be mapped: %s",
+                  options.shutdownTimeout.count(), desc);
+    });
+
+    // Lease actually requested; may drop to 0 if the router turns out to only support permanent mappings
+    std::chrono::seconds lease = options.lease;
+    // The router's uptime as last read every UptimeInterval, to spot reboots by it going down. Once we have seen it go
+    // up, we trust it to tell us of reboots, and refresh permanent mappings much less often.
+    std::optional<uint32_t> uptime;
+    bool uptimeWorks = false;
+    bool readUptime = true; // turned off if the router doesn't implement GetStatusInfo
+    Clock::time_point uptimeDue{};
+    // When the next pass (renewals, retries, reconciling) is due. The uptime probe may wake us up before then, to do
+    // just that.
+    Clock::time_point passDue{};
+    const auto refreshInterval = [&] {
+        return uptimeWorks ? Clock::duration(UptimeRefreshInterval) : Clock::duration(RefreshInterval);
+    };
+    std::mt19937 rng{std::random_device{}()};
+    DeadlineQueue renewals;
+    // Failed mappings, each retried after its own backoff delay. Mappings waiting in `retries` are left out of
+    // passes until they are due.
+    DeadlineQueue retries;
+    ProtoBitmaps waiting;
+    std::array<std::unordered_map<uint16_t, Backoff>, NumProtos> backoffs; ///< mappings whose last attempt failed
+    // Mappings that failed with a permanent error. These are left alone until something changes on the router's
+    // side, which for now means until we redo IGD setup.
+    ProtoBitmaps parked;
+    // Mappings being moved over from our previous address. Until the router's mappings for that address have expired
+    // (`movedUntil`), a conflict or refusal for one of these just means the router still holds the old one, so it gets
+    // retried rather than parked.
+    ProtoBitmaps moved;
+    Clock::time_point movedUntil{};
+    const auto scheduleRetry = [&](Proto proto, uint16_t prt) {
+        const auto delay = backoffs[size_t(proto)][prt].next(RetryBase, options.retryCap, rng);
+        Debug("Will retry %u/%s in %1.1f sec", prt, protoName(proto), std::chrono::duration<double>(delay).count());
+        retries.push({Clock::now() + delay, proto, prt});
+        waiting[size_t(proto)].set(prt);
+    };
+
+    // Whether to look mappings up before (re)adding them; turned off if the router doesn't implement the lookup
+    bool verify = options.verify;
+    const auto igdV2 = [&ctx] { return std::string_view(ctx.data.first.servicetype).ends_with(":2"); };
+    // Whether to let the router pick the external port (AddAnyPortMapping); only IGDv2 has that
+    bool anyPort = options.anyPort && igdV2();
+    if (options.anyPort && !anyPort)
+        Warning("UPnP: Router doesn't implement IGDv2, so can't let it pick external ports; ignoring --any-port");
+
+    // Sends AddPortMapping for every mapping in `todo`, scheduling the renewal of each one that succeeds. If
+    // `lookupFirst` is set, each mapping is first looked up with GetSpecificPortMappingEntry, and only (re)added if the
+    // router doesn't have it, has it pointing elsewhere, or has it about to expire.
+    const auto addMappings = [&](const ProtoBitmaps &todo, bool lookupFirst) {
+        BitmapCursor cursor(todo);
+        std::deque<std::pair<Proto, uint16_t>> writes; // mappings the callbacks found need an AddPortMapping
+
+        const auto makeAdd = [&](SoapClient::Request &req, Proto proto, uint16_t prt) {
+            const uint16_t ext = extPortOf(proto, prt);
+            const bool any = anyPort;
+            const std::string port = strprintf("%u", prt), extStr = strprintf("%u", ext),
+                              leaseStr = strprintf("%d", lease.count());
+            Debug() << "Mapping " << extStr << "/" << protoName(proto) << (ext != prt ? " -> " + port : "") << " ...";
+            // AddAnyPortMapping takes the same arguments, with the external port being merely a preference
+            req = {any ? "AddAnyPortMapping" : "AddPortMapping",
+                   SoapClient::addPortMappingArgs(extStr, port, ctx.lanaddr, name, protoName(proto), leaseStr),
+                   [&, proto, prt, ext, port, extStr, leaseStr, any](int r, SoapClient::Args &&out) {
+                PortBitmap &bm = mapped[size_t(proto)];
+                if (r == SoapClient::Aborted) {
+                    // Interrupted: the router may or may not have created the mapping, so have cleanup remove it
+                    bm.set(prt);
+                } else if (r == 725 /* OnlyPermanentLeasesSupported */ && leaseStr != "0") {
+                    if (lease.count()) {
+                        Warning("UPnP: Router only supports permanent mappings, will refresh them every %d minutes"
+                                " instead", std::chrono::duration_cast<std::chrono::minutes>(refreshInterval()).count());
+                        lease = lease.zero();
+                    }
+                    bm.reset(prt);
+                    writes.emplace_back(proto, prt); // resend right away as a permanent mapping
+                } else if (any && (r == 401 /* InvalidAction */ || r == 602 /* OptionalActionNotImplemented */)) {
+                    if (std::exchange(anyPort, false))
+                        Warning("UPnP: Router doesn't support AddAnyPortMapping (code %d), will only ask for the"
+                                " requested external ports", r);
+                    bm.reset(prt);
+                    writes.emplace_back(proto, prt);
+                } else if (r != UPNPCOMMAND_SUCCESS) {
+                    Error("%s(%s, %s, %s, %s) failed with code %d (%s)", any ? "AddAnyPortMapping" : "AddPortMapping",
+                          extStr, port, ctx.lanaddr, protoName(proto), r, errorName(r));
+                    bm.reset(prt);
+                    const bool heldForOldAddr = (r == 718 /* ConflictInMappingEntry */ || r == 606 /* NotAuthorized */)
+                                                && moved[size_t(proto)].test(prt) && Clock::now() < movedUntil;
+                    if (classifyError(r) == ErrorClass::Permanent && !heldForOldAddr) {
+                        Warning("Not retrying %s/%s, since the router will keep refusing it", port, protoName(proto));
+                        parked[size_t(proto)].set(prt);
+                        backoffs[size_t(proto)].erase(prt);
+                    } else {
+                        scheduleRetry(proto, prt);
+                    }
                 } else {
-                    Log("UPnP: GetExternalIPAddress failed.");
+                    moved[size_t(proto)].reset(prt);
+                    uint16_t assigned = ext;
+                    if (any) {
+                        // The router tells us which external port it picked, which need not be the one we asked for
+                        const auto reserved = SoapClient::argValue(out, "NewReservedPort");
+                        if (uint16_t p{}; std::from_chars(reserved.data(), reserved.data() + reserved.size(), p).ec
+                                              == std::errc{} && p)
+                            assigned = p;
+                        if (assigned != options.extPorts[size_t(proto)].external(prt))
+                            extPorts[size_t(proto)][prt] = assigned;
+                        else
+                            extPorts[size_t(proto)].erase(prt);
+                    }
+                    if (assigned == prt)
+                        Log("UPnP Port Mapping of port %s/%s successful.", port, protoName(proto));
+                    else
+                        Log("UPnP Port Mapping of external port %u to port %s/%s successful.", assigned, port,
+                            protoName(proto));
+                    bm.set(prt);
+                    backoffs[size_t(proto)].erase(prt);
+                    renewals.push({Clock::now() + renewalDelay(lease, rng, refreshInterval()), proto, prt});
+                }
+            }};
+        };
+
+        const auto makeLookup = [&](SoapClient::Request &req, Proto proto, uint16_t prt) {
+            const std::string port = strprintf("%u", prt), extStr = strprintf("%u", extPortOf(proto, prt));
+            Debug() << "Looking up " << extStr << "/" << protoName(proto) << " ...";
+            req = {"GetSpecificPortMappingEntry", SoapClient::getSpecificPortMappingEntryArgs(extStr, protoName(proto)),
+                   [&, proto, prt, extStr](int r, SoapClient::Args &&out) {
+                if (r == SoapClient::Aborted) return; // leave the mapping as it was
+                if (r == UPNPCOMMAND_SUCCESS) {
+                    const auto e = SoapClient::portMappingEntry(out);
+                    if (e.inClient == ctx.lanaddr && e.inPort == prt && e.enabled && leaseFresh(e.leaseDuration, lease)) {
+                        Debug("Port mapping %s/%s is present, not re-adding it", extStr, protoName(proto));
+                        mapped[size_t(proto)].set(prt);
+                        renewals.push({Clock::now() + renewalDelay(std::chrono::seconds{e.leaseDuration}, rng,
+                                                                   refreshInterval()), proto, prt});
+                        return;
+                    }
+                } else if (r == 401 /* InvalidAction */ || r == 602 /* OptionalActionNotImplemented */) {
+                    if (std::exchange(verify, false))
+                        Warning("UPnP: Router can't look up port mappings (code %d), will no longer verify them", r);
                 }
+                writes.emplace_back(proto, prt);
+            }};
+        };
+
+        ctx.soap.run([&](SoapClient::Request &req) {
+            Proto proto;
+            uint16_t prt;
+            if (!writes.empty()) {
+                std::tie(proto, prt) = writes.front();
+                writes.pop_front();
+                makeAdd(req, proto, prt);
+            } else if (!cursor(proto, prt)) {
+                return false;
+            } else if (lookupFirst && verify) {
+                makeLookup(req, proto, prt);
+            } else {
+                makeAdd(req, proto, prt);
             }
             return true;
-        }
-        ~UpnpCtx() noexcept { cleanup(); }
-    } ctx;
+        }, &interrupt);
+    };
 
-    if (!ctx.setup()) return; // failure, exit thread with errorFlag set
+    // Whether to read the router's whole mapping table each pass; turned off if the router can't list its mappings
+    bool reconcile = options.reconcile;
+    // When the table is next read: once per RefreshInterval, or earlier if a renewal falls due. Passes for retries
+    // alone just re-add the mappings concerned.
+    Clock::time_point reconcileDue{};
+    // Whether to try GetListOfPortMappings (IGDv2 only) before falling back to paging with GetGenericPortMappingEntry
+    bool useListing = true;
 
-    std::set<uint16_t> mappedPorts;
-
-    Defer cleanup([&mappedPorts, &ctx]{
-        if (!ctx.urls.controlURL) return;
-        for (const auto prt : mappedPorts) {
-            const std::string port = strprintf("%u", prt);
-            Debug() << "Unmapping " << port << " ...";
-            const int res = UPNP_DeletePortMapping(ctx.urls.controlURL, ctx.data.first.servicetype, port.c_str(), "TCP", 0);
-            Log("UPNP_DeletePortMapping() for %s: %s", port, res == 0 ? "success"
-                                                                      : strprintf("returned %d", res));
+    // Reads the router's port mapping table into `table`, returning UPNPCOMMAND_SUCCESS or the first error
+    const auto readListing = [&](std::vector<SoapClient::PortMappingEntry> &table) {
+        for (const Proto p : AllProtos) {
+            for (uint32_t start = 1; start <= 65535u; ) {
+                SoapClient::Args out;
+                const int r = ctx.soap.call("GetListOfPortMappings",
+                                            SoapClient::getListOfPortMappingsArgs(uint16_t(start), 65535, protoName(p),
+                                                                                  ListPageSize),
+                                            &out, &interrupt);
+                if (r == 730 /* PortMappingNotFound */) break; // no (more) entries for this protocol
+                if (r != UPNPCOMMAND_SUCCESS) return r;
+                auto page = SoapClient::parsePortListing(out);
+                uint32_t last = 0;
+                for (auto &e : page) {
+                    last = std::max<uint32_t>(last, e.extPort);
+                    table.push_back(std::move(e));
+                }
+                if (page.size() < ListPageSize || last < start) break;
+                start = last + 1u;
+            }
         }
-    });
-
-    errorFlag = false; // ok, we are not in an early error return anymore
+        return int(UPNPCOMMAND_SUCCESS);
+    };
+    const auto readIndexed = [&](std::vector<SoapClient::PortMappingEntry> &table) {
+        // The entries are independent of one another, so we keep several in flight and stop handing out indices once
+        // one of them runs off the end of the table
+        unsigned next = 0;
+        bool end = false;
+        int result = UPNPCOMMAND_SUCCESS;
+        const bool completed = ctx.soap.run([&](SoapClient::Request &req) {
+            if (end || next >= MaxTableEntries) return false;
+            const unsigned index = next++;
+            req = {"GetGenericPortMappingEntry", SoapClient::getGenericPortMappingEntryArgs(index),
+                   [&, index](int r, SoapClient::Args &&out) {
+                if (r == UPNPCOMMAND_SUCCESS) {
+                    table.push_back(SoapClient::portMappingEntry(out));
+                    return;
+                }
+                end = true;
+                // 713 (SpecifiedArrayIndexInvalid) is how the end of the table is normally signalled, but some
+                // routers say 714 (NoSuchEntryInArray) instead
+                if (r != 713 && r != 714 && (result == UPNPCOMMAND_SUCCESS || index == 0)) result = r;
+            }};
+            return true;
+        }, &interrupt);
+        return completed ? result : SoapClient::Aborted;
+    };
+    const auto readTable = [&](std::vector<SoapClient::PortMappingEntry> &table) {
+        if (useListing && igdV2()) {
+            const int r = readListing(table);
+            if (r != 401 /* InvalidAction */ && r != 602 /* OptionalActionNotImplemented */) return r;
+            Debug("GetListOfPortMappings not supported (code %d), will page through the mapping table instead", r);
+            useListing = false;
+            table.clear();
+        }
+        return readIndexed(table);
+    };
 
+    // Each pass only sends requests for the mappings that are "dirty": those that are due for renewal or for a retry,
+    // plus those we want but don't have and aren't waiting to retry (initially all of them). Steady-state traffic thus
+    // scales with the number of failures rather than with the number of ports, and each failure backs off on its own.
+    // When reconciling, the router's table rather than our renewal schedule decides what is missing or about to expire.
+    // If an entire pass fails, the IGD as a whole backs off before we redo discovery.
+    Backoff igdBackoff;
+    // Besides when something is due, we wake up when the router announces that it has restarted, which wipes its
+    // mappings, so that they come back within seconds rather than at the next refresh
+    ThreadInterrupt wake; // set on stop too
+    const size_t wakeSub = interrupt.subscribe([&wake] { wake(); });
+    Defer d([&] { interrupt.unsubscribe(wakeSub); });
+    IgdWatch watch(name + "/ssdp", {&wake});
+    watch.follow(ctx.urls.rootdescURL ? ctx.urls.rootdescURL : "");
+    uint64_t restarts = watch.restarts(), arrivals = watch.arrivals();
+    // ...and when our own address or routes change, which can leave the router forwarding to an address we no longer
+    // have
+    AddressWatch addrWatch(name + "/net", {&wake});
+    uint64_t addrChanges = addrWatch.changes();
+    // Forgets every mapping, as when the router has lost them, so that they all get redone right away. Done before the
+    // setup check at the top of a pass, this also has the IGD set up afresh.
+    const auto forgetAll = [&] {
+        mapped = parked = waiting = moved = {};
+        renewals = retries = {};
+        for (const Proto p : AllProtos) {
+            backoffs[size_t(p)].clear();
+            extPorts[size_t(p)].clear();
+        }
+        igdBackoff.reset();
+        passDue = {};
+    };
+    const auto allParked = [&] {
+        for (const Proto p : AllProtos)
+            if ((desired[size_t(p)] - parked[size_t(p)]).any()) return false;
+        return true;
+    };
+    // Nothing mapped at all, and it's not just that everything is parked, or still held for our previous address
+    const auto igdInTrouble = [&] {
+        return !anySet(mapped) && !allParked() && !(anySet(moved) && Clock::now() < movedUntil);
+    };
     uint64_t iters{};
     std::chrono::milliseconds wait_time;
     do {
+        wake.reset(); // before checking `interrupt`, so a stop() in between still ends the wait below
         if (interrupt) break;
+        if (const uint64_t n = watch.restarts(); n != restarts) {
+            // The router has forgotten our mappings, and may have moved: set it up afresh and redo them all right away
+            restarts = n;
+            if (ctx.urls.rootdescURL) DescCache::instance().erase(ctx.urls.rootdescURL);
+            forgetAll();
+        }
+        if (const uint64_t n = watch.arrivals(); n != arrivals) {
+            // An IGD has turned up since we last looked: if setting it up fails, retry soon, it may be still booting
+            arrivals = n;
+            igdBackoff.reset();
+        }
+        if (const uint64_t n = addrWatch.changes(); n != addrChanges) {
+            addrChanges = n;
+            const auto ctl = ctx.urls.controlURL ? Net::parseHttpUrl(ctx.urls.controlURL) : std::nullopt;
+            const auto local = ctl ? Net::localAddressFor(ctl->host, ctl->port) : std::nullopt;
+            if (!ctl) {
+                // Not set up, so there's nothing to fix: the pass below retries setup anyway
+            } else if (!local || local->size() >= sizeof(ctx.lanaddr)) {
+                Log("UPnP: lost our route to the IGD, redoing discovery");
+                forgetAll();
+            } else if (*local != ctx.lanaddr) {
+                // The router won't point an external port at us while it still points at our old address, so we take
+                // the old mappings down first, one by one (DeletePortMappingRange only deletes the caller's own). A
+                // router that only lets hosts delete their own mappings refuses; those then stay in the way until
+                // their leases run out, and we keep retrying until they do (see `moved`).
+                Log("UPnP: our address changed from %s to %s, moving %u mapping(s) over", ctx.lanaddr, *local,
+                    countSet(mapped));
+                // New connections, from our new address
+                if (!ctx.soap.setup(ctx.urls.controlURL, ctx.data.first.servicetype, options.maxJobs)) {
+                    Error("Unsupported IGD control URL: %s", ctx.urls.controlURL);
+                    forgetAll();
+                } else {
+                    const ProtoBitmaps moving = mapped;
+                    const PortSets left = unmap(moving, false, Clock::now() + options.shutdownTimeout, &interrupt);
+                    if (interrupt) break; // leave what we couldn't unmap to cleanup
+                    size_t n = 0;
+                    for (const PortSet &ps : left) n += ps.size();
+                    if (n)
+                        Log("UPnP: could not remove %u of the old mapping(s) in time, retrying the moves until they"
+                            " expire", n);
+                    std::strcpy(ctx.lanaddr, local->c_str());
+                    ctx.saveCache();
+                    mapped = {};
+                    renewals = {};
+                    moved = moving;
+                    movedUntil = lease.count() ? Clock::now() + lease : Clock::time_point::max();
+                    addMappings(moving, false);
+                }
+            }
+        }
         // Redo context setup if we couldn't map anything -- we may have gotten a new IP address or other
         // shenanigans...
         bool ok = true;
-        if (iters++ && mappedPorts.empty()) {
+        if (iters++ && igdInTrouble()) {
             Debug() << "Redoing UPNP context ...";
-            ok = ctx.setup();
-        }
-        if (ok) {
-            for (const auto prt : ports) {
-                const std::string port = strprintf("%u", prt);
-                Debug() << "Mapping " << port << " ...";
-                int r;
-    #ifndef UPNPDISCOVER_SUCCESS
-                /* miniupnpc 1.5 */
-                r = UPNP_AddPortMapping(ctx.urls.controlURL, ctx.data.first.servicetype,
-                                        port.c_str(), port.c_str(), ctx.lanaddr,
-                                        name.c_str(), "TCP", 0);
-    #else
-                /* miniupnpc 1.6 */
-                r = UPNP_AddPortMapping(ctx.urls.controlURL, ctx.data.first.servicetype,
-                                        port.c_str(), port.c_str(), ctx.lanaddr,
-                                        name.c_str(), "TCP", 0, "0");
-    #endif
-
-                if (r != UPNPCOMMAND_SUCCESS) {
-                    Error("AddPortMapping(%s, %s, %s) failed with code %d (%s)", port, port, ctx.lanaddr, r, strupnperror(r));
-                    mappedPorts.erase(prt);
+            ok = ctx.setup(options.maxJobs, interrupt);
+            // If discovery failed, follow none, so that any IGD that comes up resets the backoff
+            watch.follow(ok && ctx.urls.rootdescURL ? ctx.urls.rootdescURL : "");
+            uptime.reset(); // it may well be another router now
+            uptimeWorks = false;
+            if (ok && anySet(parked)) {
+                Debug("Giving the %u parked mapping(s) another chance", countSet(parked));
+                parked = {};
+            }
+            reconcileDue = {}; // the router may have some of ours already
+            passDue = {};
+        }
+        if (ok && readUptime && Clock::now() >= uptimeDue) {
+            // A cheap read, which saves refreshing permanent mappings often just in case the router rebooted. Note that
+            // many routers report the uptime of their WAN connection rather than their own, so a reconnect looks like a
+            // reboot too; remapping is harmless then.
+            uint32_t up{};
+            const int r = ctx.soap.getUptime(up, &interrupt);
+            uptimeDue = Clock::now() + UptimeInterval;
+            if (r == UPNPCOMMAND_SUCCESS) {
+                if (uptime && up < *uptime) {
+                    Log("UPnP: Router's uptime went from %u to %u sec, so it rebooted: remapping everything", *uptime, up);
+                    forgetAll();
+                } else if (uptime && up > *uptime && !std::exchange(uptimeWorks, true)) {
+                    Debug("Router reports its uptime, will refresh permanent mappings every %d hours",
+                          UptimeRefreshInterval.count());
+                }
+                uptime = up;
+            } else if (r == 401 /* InvalidAction */ || r == 602 /* OptionalActionNotImplemented */) {
+                Debug("Router can't report its uptime (code %d), will refresh permanent mappings every %d minutes", r,
+                      RefreshInterval.count());
+                readUptime = uptimeWorks = false;
+            } else if (r != SoapClient::Aborted) {
+                Debug("Could not read the router's uptime (code %d)", r);
+            }
+        }
+        const bool doPass = Clock::now() >= passDue;
+        if (ok && doPass) {
+            // Retries that are due rejoin the pass
+            size_t nRetries = 0;
+            for (const auto now = Clock::now(); !retries.empty() && retries.top().due <= now; retries.pop(), ++nRetries)
+                waiting[size_t(retries.top().proto)].reset(retries.top().port);
+
+            ProtoBitmaps dirty;
+            bool reconciled = false;
+            const bool renewalDue = !renewals.empty() && renewals.top().due <= Clock::now();
+            if (reconcile && (renewalDue || Clock::now() >= reconcileDue)) {
+                // Diff the router's table against what we want: keep the entries that are ours and not about to
+                // expire, and (re)add everything else. This replaces the renewal schedule.
+                std::vector<SoapClient::PortMappingEntry> table;
+                if (const int r = readTable(table); r == UPNPCOMMAND_SUCCESS) {
+                    const auto now = Clock::now();
+                    ProtoBitmaps present;
+                    renewals = {};
+                    for (const auto &e : table) {
+                        const auto proto = parseProto(e.proto);
+                        if (!proto || !desired[size_t(*proto)].test(e.inPort) || e.inClient != ctx.lanaddr
+                                || e.extPort != extPortOf(*proto, e.inPort) || !e.enabled
+                                || !leaseFresh(e.leaseDuration, lease))
+                            continue;
+                        present[size_t(*proto)].set(e.inPort);
+                        // Check again once it's no longer fresh, so that everything renewed in one pass stays in step
+                        // and gets renewed together by a single later pass
+                        const auto left = std::chrono::seconds{e.leaseDuration};
+                        renewals.push({now + (left.count() ? Clock::duration(left - lease / 2)
+                                                         : renewalDelay(left, rng, refreshInterval())),
+                                       *proto, e.inPort});
+                    }
+                    size_t nMissing = 0;
+                    for (const Proto p : AllProtos) {
+                        mapped[size_t(p)] = present[size_t(p)];
+                        dirty[size_t(p)] = desired[size_t(p)] - present[size_t(p)] - waiting[size_t(p)] - parked[size_t(p)];
+                        nMissing += dirty[size_t(p)].count();
+                    }
+                    Debug("Router has %u mapping(s), %u of ours are in place, (re)adding %u ...", table.size(),
+                          countSet(present), nMissing);
+                    if (nMissing) addMappings(dirty, false);
+                    reconciled = true;
+                    reconcileDue = now + RefreshInterval;
+                } else if (r == 401 || r == 602) {
+                    Warning("UPnP: Router can't list its port mappings (code %d), will no longer reconcile against"
+                            " its table", r);
+                    reconcile = false;
+                } else if (r != SoapClient::Aborted) {
+                    Debug("Could not read the router's mapping table (code %d), falling back to a regular pass", r);
+                }
+            }
+            if (!reconciled && !interrupt) {
+                size_t nDue = 0;
+                for (const auto now = Clock::now(); !renewals.empty() && renewals.top().due <= now; renewals.pop()) {
+                    // skip entries for mappings that have since been lost; they get retried as failures instead
+                    if (mapped[size_t(renewals.top().proto)].test(renewals.top().port)) {
+                        dirty[size_t(renewals.top().proto)].set(renewals.top().port);
+                        ++nDue;
+                    }
+                }
+                size_t nMissing = 0;
+                for (const Proto p : AllProtos) {
+                    const PortBitmap missing = desired[size_t(p)] - mapped[size_t(p)] - waiting[size_t(p)]
+                                               - parked[size_t(p)];
+                    nMissing += missing.count();
+                    dirty[size_t(p)] |= missing;
+                }
+                if (nDue || nMissing) {
+                    Debug("Renewing %u and (re)trying %u mapping(s) (%u due for retry) ...", nDue, nMissing, nRetries);
+                    addMappings(dirty, true);
+                }
+            }
+            if (!interrupt) {
+                for (const Proto p : AllProtos) {
+                    if (const size_t nFailed = (desired[size_t(p)] - mapped[size_t(p)]).count())
+                        Warning("%u of %u %s port mapping(s) could not be established (%u parked)", nFailed,
+                                desired[size_t(p)].count(), protoName(p), parked[size_t(p)].count());
+                }
+            }
+        }
+        // Sleep until the next renewal or retry is due, or the uptime probe. If the IGD itself is in trouble, back off
+        // as a whole, since the next pass redoes discovery.
+        const auto now = Clock::now();
+        Clock::time_point wakeAt;
+        if (!ok || igdInTrouble()) {
+            wakeAt = passDue = now + igdBackoff.next(RetryBase, options.retryCap, rng);
+        } else {
+            igdBackoff.reset();
+            if (doPass) passDue = now + RefreshInterval;
+            if (!renewals.empty()) passDue = std::min(passDue, renewals.top().due);
+            if (!retries.empty()) passDue = std::min(passDue, retries.top().due);
+            wakeAt = passDue;
+            if (readUptime) wakeAt = std::min(wakeAt, uptimeDue);
+        }
+        wait_time = std::chrono::ceil<std::chrono::milliseconds>(std::max(wakeAt - now, Clock::duration::zero()));
+    } while (!wake.wait(wait_time) || !interrupt);
+    return true;
+}
+
+bool UpnpMgr::runFleet()
+{
+    const FleetTable &fleet = options.fleet;
+    const size_t nShards = std::clamp<size_t>(options.fleetWorkers, 1u, fleet.size());
+    std::vector<uint32_t> clients;
+    fleet.forEach([&](const FleetEntry &e) { clients.push_back(e.client); });
+    std::sort(clients.begin(), clients.end());
+    clients.erase(std::unique(clients.begin(), clients.end()), clients.end());
+    Log() << "UPNP thread started, will manage " << fleet.size() << " port mapping(s) for " << clients.size()
+          << " LAN host(s) using " << nShards << " worker thread(s) of up to " << options.maxJobs
+          << " concurrent request(s) each and a lease of "
+          << (options.lease.count() ? strprintf("%d sec", options.lease.count()) : std::string("forever"))
+          << ", probing for IGDs ...";
+
+    UpnpCtx ctx;
+    ctx.descURL = options.igdUrl;
+    ctx.cachePath = options.igdCache;
+    ctx.discoverTimeout = options.discoverTimeout;
+    if (!ctx.setup(options.maxJobs, interrupt))
+        return bool(interrupt); // not an error if we were told to stop while still setting up
+    ctx.soap.reset(); // the workers make their own connections
+
+    // Each worker owns one shard of the fleet outright, so they never need to lock anything
+    std::vector<FleetTable> shards(nShards);
+    for (auto &shard : shards) shard.reserve(fleet.size() / nShards + 1u);
+    fleet.forEach([&](const FleetEntry &e) { shards[(FleetTable::hash(e.key()) >> 32) % nShards].insert(e); });
+
+    const auto epoch = Clock::now();
+    // Scheduling state is kept in whole seconds since `epoch`, to keep the entries small
+    const auto secsSince = [epoch](Clock::time_point t) {
+        return uint32_t(std::chrono::duration_cast<std::chrono::seconds>(t - epoch).count());
+    };
+    const auto secsFrom = [](Clock::duration d) {
+        return uint32_t(std::chrono::ceil<std::chrono::seconds>(d).count());
+    };
+
+    // The workers talk to the control URL found by the latest setup. This thread sets the IGD up again when the router
+    // restarts, or (as runIgd() does) when none of the workers has anything mapped, and then hands them the new URL.
+    std::mutex igdMut;
+    std::string controlURL = ctx.urls.controlURL, serviceType = ctx.data.first.servicetype; // guarded by igdMut
+    uint64_t remapGen = 0; // guarded by igdMut; the last setup that followed a router restart
+    std::atomic<uint64_t> igdGen{0}; // bumped on each new setup
+    /// How each worker's shard fared in its last pass since the latest setup
+    enum Health : uint8_t { Unknown /* no pass yet */, Healthy, Stranded /* nothing mapped */, AllParked };
+    std::vector<std::atomic<Health>> health(nShards);
+    for (auto &h : health) h = Unknown;
+
+    // As in runIgd(), this thread also wakes up when the router announces that it has restarted
+    ThreadInterrupt superWake; // set on stop too, and by workers left with nothing mapped
+    std::vector<ThreadInterrupt> wakes(nShards); // set on stop too, and when there is a new setup
+    const size_t wakeSub = interrupt.subscribe([&] {
+        superWake();
+        for (auto &w : wakes) w();
+    });
+    Defer d([&] { interrupt.unsubscribe(wakeSub); });
+    IgdWatch watch(name + "/ssdp", {&superWake});
+    watch.follow(ctx.urls.rootdescURL ? ctx.urls.rootdescURL : "");
+
+    const auto runShard = [&](FleetTable &shard, ThreadInterrupt &wake, std::atomic<Health> &myHealth) {
+        SoapClient soap;
+        uint64_t gen, remapped;
+        const auto setupSoap = [&] {
+            std::unique_lock l(igdMut);
+            gen = igdGen;
+            remapped = remapGen;
+            if (soap.setup(controlURL, serviceType, options.maxJobs)) return true;
+            Error("Unsupported IGD control URL: %s", controlURL);
+            return false;
+        };
+        if (!setupSoap()) return;
+        std::vector<FleetEntry> &slots = shard.slots();
+        std::chrono::seconds lease = options.lease;
+        std::mt19937 rng{std::random_device{}()};
+
+        Defer cleanup([&]{
+            // Unmap everything we have (or may have), as in runIgd(), but one mapping at a time: DeletePortMappingRange
+            // only ever deletes our own mappings, not those of other hosts
+            size_t next = 0, unfinished = 0;
+            soap.run([&](SoapClient::Request &req) {
+                while (next < slots.size() && slots[next].state != FleetEntry::Mapped) ++next;
+                if (next == slots.size()) return false;
+                const FleetEntry &e = slots[next++];
+                const std::string extStr = strprintf("%u", e.extPort);
+                Debug() << "Unmapping " << extStr << "/" << protoName(e.proto) << " ...";
+                req = {"DeletePortMapping", SoapClient::deletePortMappingArgs(extStr, protoName(e.proto)),
+                       [&, extStr, proto = e.proto](int r, auto &&) {
+                    if (r == SoapClient::Aborted) ++unfinished;
+                    else if (r != UPNPCOMMAND_SUCCESS)
+                        Log("DeletePortMapping() for %s/%s returned %d (%s)", extStr, protoName(proto), r, errorName(r));
+                }};
+                return true;
+            }, nullptr, Clock::now() + options.shutdownTimeout);
+            for ( ; next < slots.size(); ++next)
+                unfinished += slots[next].state == FleetEntry::Mapped;
+            if (unfinished)
+                Error("Unmapping did not finish within %d sec; %u mapping(s) may still be in place",
+                      options.shutdownTimeout.count(), unfinished);
+        });
+
+        std::deque<size_t> resend; // slots to send again right away (as permanent mappings, after a 725)
+        const auto makeAdd = [&](SoapClient::Request &req, size_t idx) {
+            const FleetEntry &e = slots[idx];
+            const std::string client = Net::formatIPv4(e.client), port = strprintf("%u", e.inPort),
+                              extStr = strprintf("%u", e.extPort), leaseStr = strprintf("%d", lease.count());
+            Debug() << "Mapping " << extStr << "/" << protoName(e.proto) << " -> " << client << ":" << port << " ...";
+            req = {"AddPortMapping",
+                   SoapClient::addPortMappingArgs(extStr, port, client, name, protoName(e.proto), leaseStr),
+                   [&, idx, client, port, extStr, leaseStr](int r, SoapClient::Args &&) {
+                FleetEntry &e = slots[idx];
+                const uint32_t now = secsSince(Clock::now());
+                if (r == SoapClient::Aborted) {
+                    e.state = FleetEntry::Mapped; // the router may or may not have created it: have cleanup remove it
+                } else if (r == 725 /* OnlyPermanentLeasesSupported */ && leaseStr != "0") {
+                    if (lease.count()) {
+                        Warning("UPnP: Router only supports permanent mappings, will refresh them every %d minutes"
+                                " instead", RefreshInterval.count());
+                        lease = lease.zero();
+                    }
+                    resend.push_back(idx);
+                } else if (r != UPNPCOMMAND_SUCCESS) {
+                    Error("AddPortMapping(%s, %s, %s, %s) failed with code %d (%s)", extStr, port, client,
+                          protoName(e.proto), r, errorName(r));
+                    if (classifyError(r) == ErrorClass::Permanent) {
+                        Warning("Not retrying %s/%s, since the router will keep refusing it", extStr, protoName(e.proto));
+                        e.state = FleetEntry::Parked;
+                        e.backoff = 0;
+                        return;
+                    }
+                    // Decorrelated jitter, as with Backoff, but in whole seconds
+                    const uint32_t base = uint32_t(RetryBase.count()), hi = std::max(base, 3u * e.backoff);
+                    const uint32_t delay = std::min<uint32_t>(std::uniform_int_distribution<uint32_t>(base, hi)(rng),
+                                                              uint32_t(options.retryCap.count()));
+                    e.state = FleetEntry::Wanted;
+                    e.backoff = uint16_t(std::min<uint32_t>(delay, UINT16_MAX));
+                    e.due = now + delay;
                 } else {
-                    Log("UPnP Port Mapping of port %s successful.", port);
-                    mappedPorts.insert(prt);
+                    Debug("UPnP Port Mapping of port %s/%s to %s:%s successful.", extStr, protoName(e.proto), client, port);
+                    e.state = FleetEntry::Mapped;
+                    e.backoff = 0;
+                    e.due = now + secsFrom(renewalDelay(lease, rng));
                 }
+            }};
+        };
+
+        std::chrono::milliseconds wait_time;
+        do {
+            wake.reset(); // first, as in runIgd()
+            if (interrupt) break;
+            if (igdGen != gen) {
+                // The IGD was set up again, maybe at another control URL: give everything not mapped another chance,
+                // and if the router restarted it has forgotten all the mappings, so redo those right away too
+                const uint64_t prevRemapped = remapped;
+                if (!setupSoap()) break;
+                shard.forEach([all = remapped != prevRemapped](FleetEntry &e) {
+                    if (e.state == FleetEntry::Mapped && !all) return;
+                    e.state = FleetEntry::Wanted;
+                    e.backoff = 0;
+                    e.due = 0;
+                });
             }
+            // Send every mapping that is due, whether for its first attempt, a retry or a renewal
+            const uint32_t now = secsSince(Clock::now());
+            size_t next = 0;
+            soap.run([&](SoapClient::Request &req) {
+                if (!resend.empty()) {
+                    makeAdd(req, resend.front());
+                    resend.pop_front();
+                    return true;
+                }
+                for ( ; next < slots.size(); ++next) {
+                    const FleetEntry &e = slots[next];
+                    if ((e.state == FleetEntry::Wanted || e.state == FleetEntry::Mapped) && e.due <= now) break;
+                }
+                if (next == slots.size()) return false;
+                makeAdd(req, next++);
+                return true;
+            }, &interrupt);
+            if (interrupt) break;
+
+            size_t nMapped = 0, nParked = 0;
+            uint32_t wakeAt = now + secsFrom(RefreshInterval);
+            shard.forEach([&](const FleetEntry &e) {
+                if (e.state == FleetEntry::Parked) { ++nParked; return; }
+                nMapped += e.state == FleetEntry::Mapped;
+                wakeAt = std::min(wakeAt, e.due);
+            });
+            if (nMapped < shard.size())
+                Warning("%u of %u fleet port mapping(s) could not be established (%u parked)", shard.size() - nMapped,
+                        shard.size(), nParked);
+            const Health h = nMapped ? Healthy : nParked == shard.size() ? AllParked : Stranded;
+            if (myHealth.exchange(h) != h && h == Stranded) superWake();
+            wait_time = std::chrono::ceil<std::chrono::milliseconds>(
+                std::max(epoch + std::chrono::seconds{wakeAt} - Clock::now(), Clock::duration::zero()));
+        } while (!wake.wait(wait_time) || !interrupt);
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nShards);
+    for (size_t i = 0; i < nShards; ++i) {
+        threads.emplace_back([this, &runShard, &shard = shards[i], &wake = wakes[i], &h = health[i], i]{
+            TraceThread(strprintf("%s/w%d", name, i + 1), [&]{ runShard(shard, wake, h); });
+        });
+    }
+
+    // Redo setup right away when the router restarts, and after a backoff delay when no worker has anything mapped
+    Backoff igdBackoff;
+    std::mt19937 rng{std::random_device{}()};
+    uint64_t restarts = watch.restarts(), arrivals = watch.arrivals();
+    bool remap = false;
+    constexpr auto Never = Clock::time_point::max();
+    auto setupAt = Never;
+    for (;;) {
+        superWake.reset();
+        if (interrupt) break;
+        const auto now = Clock::now();
+        if (const uint64_t n = watch.restarts(); n != restarts) {
+            restarts = n;
+            if (ctx.urls.rootdescURL) DescCache::instance().erase(ctx.urls.rootdescURL);
+            remap = true;
+            setupAt = now;
+        }
+        if (const uint64_t n = watch.arrivals(); n != arrivals) {
+            arrivals = n; // as in runIgd()
+            igdBackoff.reset();
+        }
+        const bool anyHealthy = std::any_of(health.begin(), health.end(), [](const auto &h) { return h == Healthy; });
+        const bool anyStranded = std::any_of(health.begin(), health.end(), [](const auto &h) { return h == Stranded; });
+        if (anyHealthy) igdBackoff.reset();
+        else if (anyStranded && setupAt == Never) setupAt = now + igdBackoff.next(RetryBase, options.retryCap, rng);
+        if (now >= setupAt) {
+            Debug() << "Redoing UPNP context ...";
+            if (ctx.setup(options.maxJobs, interrupt)) {
+                ctx.soap.reset();
+                watch.follow(ctx.urls.rootdescURL ? ctx.urls.rootdescURL : "");
+                {
+                    std::unique_lock l(igdMut);
+                    controlURL = ctx.urls.controlURL;
+                    serviceType = ctx.data.first.servicetype;
+                    if (std::exchange(remap, false)) remapGen = igdGen + 1;
+                    ++igdGen;
+                }
+                for (auto &h : health) h = Unknown;
+                for (auto &w : wakes) w();
+                setupAt = Never;
+            } else {
+                if (interrupt) break;
+                watch.follow("");
+                setupAt = Clock::now() + igdBackoff.next(RetryBase, options.retryCap, rng);
+            }
+            continue;
         }
-        wait_time = !ok || mappedPorts.empty() ? std::chrono::minutes{1} : std::chrono::minutes{20};
-    } while (!interrupt.wait(wait_time));
+        superWake.wait(setupAt != Never ? std::optional(std::chrono::ceil<std::chrono::milliseconds>(setupAt - now))
+                               : std::nullopt);
+    }
+    for (auto &t : threads) t.join();
+    return true;
 }
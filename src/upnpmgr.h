@@ -1,13 +1,17 @@
 #pragma once
 
+#include "fleettable.h"
+#include "portset.h"
 #include "threadinterrupt.h"
 
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <thread>
 #include <string>
 #include <string_view>
-#include <vector>
+#include <utility>
 
 class UpnpMgr
 {
@@ -15,17 +19,90 @@ public:
     UpnpMgr(std::string_view name = "UpnpMgr");
     ~UpnpMgr();
 
-    using PortVec = std::vector<uint16_t>;
+    /// The ports we want mapped, indexed by Proto
+    using PortSets = std::array<PortSet, NumProtos>;
+    /// The external port to request for each of those ports, where not the same as the port itself; indexed by Proto
+    using PortMaps = std::array<PortMap, NumProtos>;
 
-    void start(PortVec ports, std::function<void()> errorCallback = {});
+    static constexpr unsigned DefaultMaxJobs = 4;
+    static constexpr std::chrono::seconds DefaultLease{3600};
+    /// How often mappings with an infinite lease are refreshed (in case the router lost them, e.g. due to a reboot)
+    static constexpr std::chrono::minutes RefreshInterval{20};
+    /// How often we read the router's uptime (GetStatusInfo), to notice when it has rebooted and lost our mappings
+    static constexpr std::chrono::seconds UptimeInterval{60};
+    /// How often mappings with an infinite lease are refreshed instead, while the router's uptime tells us of reboots
+    static constexpr std::chrono::hours UptimeRefreshInterval{4};
+    /// Failed mappings are first retried after a random delay of about this much, growing exponentially from there
+    static constexpr std::chrono::seconds RetryBase{2};
+    static constexpr std::chrono::seconds DefaultRetryCap{600};
+    static constexpr std::chrono::seconds DefaultShutdownTimeout{8};
+    static constexpr unsigned DefaultFleetWorkers = 4;
+    static constexpr std::chrono::milliseconds DefaultDiscoverTimeout{2000};
+
+    struct Options {
+        /// Maximum number of SOAP requests (and thus connections) to have in flight to the router at once.
+        unsigned maxJobs = DefaultMaxJobs;
+        /// Lease duration requested for each mapping. Mappings are renewed shortly before their lease runs out, so
+        /// that they go away on their own if we die without cleaning up. 0 requests permanent mappings, which are
+        /// refreshed every RefreshInterval instead (UptimeRefreshInterval, while the router's uptime tells us of
+        /// reboots).
+        std::chrono::seconds lease = DefaultLease;
+        /// Look each mapping up with GetSpecificPortMappingEntry before (re)adding it, and skip the AddPortMapping if
+        /// the router already has it pointing at us. Lookups are much cheaper than writes on many routers, and
+        /// re-adding an existing mapping may make them rewrite their NAT table or flush connection tracking state.
+        bool verify = false;
+        /// When renewals fall due (and at least every RefreshInterval), read the router's whole mapping table in
+        /// bulk (GetListOfPortMappings on IGDv2, otherwise GetGenericPortMappingEntry for each index) and diff it
+        /// against the desired set, so that only the mappings that are missing, wrong or about to expire get
+        /// (re)added. Retries in between are plain adds. Takes precedence over `verify`.
+        bool reconcile = false;
+        /// Map each port with AddAnyPortMapping (IGDv2 only), letting the router pick another external port if the
+        /// one we ask for is taken, rather than failing with ConflictInMappingEntry and retrying forever.
+        bool anyPort = false;
+        /// Upper bound on the delay before retrying a failed mapping (or an IGD that failed as a whole)
+        std::chrono::seconds retryCap = DefaultRetryCap;
+        /// How long stop() may spend removing our mappings from the router before giving up on the rest
+        std::chrono::seconds shutdownTimeout = DefaultShutdownTimeout;
+        /// Manage the mappings on every connected IGD found on the network rather than just the best one, each from
+        /// its own thread with its own connections, schedule and failure handling. For hosts behind several routers.
+        bool allIgds = false;
+        /// External ports to map the ports onto, for those that shouldn't use the same port number on the outside
+        PortMaps extPorts;
+        /// Fleet mode: if not empty, map these on behalf of the LAN hosts they name, instead of `ports` for this host.
+        /// The fleet is sharded across `fleetWorkers` threads, each with its own connections to the router (up to
+        /// `maxJobs` of them) and its own schedule. `verify`, `reconcile`, `anyPort`, `allIgds` and `extPorts` don't
+        /// apply (each entry carries its own external port).
+        FleetTable fleet;
+        unsigned fleetWorkers = DefaultFleetWorkers;
+        /// Upper bound on how long to wait for IGDs to answer discovery. Normally we stop waiting as soon as a usable
+        /// IGD has answered, and re-discovery first waits only a window learned from how fast IGDs answered before, but
+        /// `allIgds` always waits this long, so as to find them all.
+        std::chrono::milliseconds discoverTimeout = DefaultDiscoverTimeout;
+        /// Root description URL of the IGD to use, e.g. "http://192.168.1.1:5000/rootDesc.xml". If not empty, SSDP
+        /// discovery is skipped entirely (which also makes it work where multicast is filtered). Not used with
+        /// `allIgds`, and takes precedence over `igdCache`.
+        std::string igdUrl;
+        /// If not empty, the IGD found by discovery is remembered in this file, and tried first on the next start
+        /// (provided it still answers) so as to skip the discovery delay. Not used with `allIgds`.
+        std::string igdCache;
+    };
+
+    void start(PortSets ports, const Options &options, std::function<void()> errorCallback = {});
+    void start(PortSets ports, std::function<void()> errorCallback = {}) { start(std::move(ports), Options{}, std::move(errorCallback)); }
     void stop();
 
 private:
     const std::string name;
     ThreadInterrupt interrupt;
-    PortVec ports;
+    PortSets ports;
+    Options options;
     std::thread thread;
     std::function<void()> errorCallback;
 
     void run();
+    /// Manages the mappings on the IGD whose root description is at `descURL` (or the one discovery picks, if empty)
+    /// until interrupted. Returns false if the IGD could not be set up at all.
+    bool runIgd(const std::string &descURL);
+    /// Manages the mappings in `options.fleet` until interrupted. Returns false if the IGD could not be set up at all.
+    bool runFleet();
 };